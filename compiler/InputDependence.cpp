@@ -0,0 +1,415 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#include "InputDependence.h"
+
+#include <llvm/ADT/Triple.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/Operator.h>
+
+using namespace llvm;
+
+namespace {
+
+/// How an intercepted function makes input available to the program.
+enum class InputFunctionKind {
+  None,
+  /// Fills the buffer given as an argument (e.g., read).
+  Buffer,
+  /// Returns input (e.g., getc).
+  Result,
+  /// Maps input into memory (e.g., mmap).
+  Mapping
+};
+
+/// Classify the function and, for input functions of kind Buffer, find the
+/// index of the buffer argument.
+InputFunctionKind getInputFunctionKind(const Function &function,
+                                       unsigned &bufferArg) {
+  // Intercepted functions have been renamed to their wrappers by now (see
+  // SymbolizePass::doInitialization).
+  auto name = function.getName();
+  name.consume_back("_symbolized");
+
+  if (name == "read") {
+    bufferArg = 1;
+    return InputFunctionKind::Buffer;
+  }
+  if (name == "fread" || name == "fgets") {
+    bufferArg = 0;
+    return InputFunctionKind::Buffer;
+  }
+  if (name == "getc" || name == "fgetc" || name == "getchar" ||
+      name == "ungetc")
+    return InputFunctionKind::Result;
+  if (name == "mmap" || name == "mmap64")
+    return InputFunctionKind::Mapping;
+
+  return InputFunctionKind::None;
+}
+
+bool isAnalyzedFunction(const Function &function) {
+  return !function.isDeclaration() &&
+         !function.hasAvailableExternallyLinkage();
+}
+
+/// Decide whether a function that the module calls but doesn't define may be
+/// instrumented code, which can produce input-dependent data in ways that the
+/// analysis doesn't see.
+bool mayBeInstrumented(const Function &function,
+                       const TargetLibraryInfo &libraryInfo) {
+  if (function.isIntrinsic() || function.use_empty())
+    return false;
+
+  // The run-time library and its wrappers of intercepted functions.
+  auto name = function.getName();
+  if (name.startswith("_sym_") || name.endswith("_symbolized"))
+    return false;
+
+  // Library functions aren't instrumented.
+  LibFunc libFunc;
+  return !libraryInfo.getLibFunc(function, libFunc);
+}
+
+} // namespace
+
+InputDependence::InputDependence(Module &M) {
+  TargetLibraryInfoImpl libraryInfoImpl(Triple(M.getTargetTriple()));
+  TargetLibraryInfo libraryInfo(libraryInfoImpl);
+
+  SmallVector<Function *, 32> functions;
+  for (auto &function : M.functions()) {
+    if (!isAnalyzedFunction(function)) {
+      if (mayBeInstrumented(function, libraryInfo))
+        opaqueFunctions.insert(&function);
+
+      // If the program calls an input function through a pointer, we can't
+      // tell where the input goes.
+      unsigned bufferArg;
+      if (getInputFunctionKind(function, bufferArg) !=
+              InputFunctionKind::None &&
+          function.hasAddressTaken())
+        return;
+      continue;
+    }
+
+    functions.push_back(&function);
+
+    // We don't know what the callers of a function pass unless we see all of
+    // them.
+    if ((!function.hasLocalLinkage() && function.getName() != "main") ||
+        function.hasAddressTaken()) {
+      for (auto &arg : function.args())
+        taint(&arg);
+    }
+
+    for (auto &I : instructions(function))
+      if (isa<AllocaInst>(I) && isTrackable(&I))
+        trackedObjects.insert(&I);
+  }
+
+  for (auto &global : M.globals())
+    if (!global.isConstant() && global.hasLocalLinkage() &&
+        isTrackable(&global))
+      trackedObjects.insert(&global);
+
+  // Unless the module is the entire program, other translation units may put
+  // input anywhere that we don't track, and the functions that they define may
+  // return it.
+  auto *main = M.getFunction("main");
+  wholeProgram =
+      main != nullptr && !main->isDeclaration() && opaqueFunctions.empty();
+  untrackedMemoryTainted = !wholeProgram;
+
+  bool changed;
+  do {
+    changed = false;
+    for (auto *function : functions)
+      for (auto &I : instructions(*function))
+        changed |= update(I);
+  } while (changed);
+
+  for (auto *function : functions)
+    for (auto &I : instructions(*function))
+      if (canSkip(I))
+        concreteInstructions[&I] = true;
+}
+
+bool InputDependence::isTrackable(const Value *object) {
+  SmallVector<const Value *, 8> worklist{object};
+  SmallPtrSet<const Value *, 8> visited{object};
+  while (!worklist.empty()) {
+    auto *pointer = worklist.pop_back_val();
+    for (const auto &use : pointer->uses()) {
+      auto *user = use.getUser();
+      if (isa<LoadInst>(user) || isa<ICmpInst>(user) ||
+          isa<MemIntrinsic>(user) || isa<DbgInfoIntrinsic>(user))
+        continue;
+
+      if (isa<StoreInst>(user)) {
+        if (use.getOperandNo() != StoreInst::getPointerOperandIndex())
+          return false;
+        continue;
+      }
+
+      if (auto *intrinsic = dyn_cast<IntrinsicInst>(user);
+          intrinsic != nullptr && intrinsic->isLifetimeStartOrEnd())
+        continue;
+
+      // Follow derived pointers, including constant expressions.
+      if (isa<GEPOperator>(user) || isa<BitCastOperator>(user) ||
+          isa<AddrSpaceCastOperator>(user) || isa<PHINode>(user) ||
+          isa<SelectInst>(user)) {
+        if (visited.insert(user).second)
+          worklist.push_back(user);
+        continue;
+      }
+
+      // Anything else may store the address somewhere or access the memory
+      // in ways that we don't see.
+      return false;
+    }
+  }
+
+  return true;
+}
+
+const InputDependence::Locations &
+InputDependence::getLocations(const Value *pointer) {
+  auto cached = locationCache.find(pointer);
+  if (cached != locationCache.end())
+    return cached->second;
+
+  SmallVector<const Value *, 4> objects;
+  getUnderlyingObjects(pointer, objects, nullptr, 0);
+
+  Locations locations;
+  for (auto *object : objects) {
+    if (auto *global = dyn_cast<GlobalVariable>(object);
+        global != nullptr && global->isConstant())
+      continue;
+
+    if (trackedObjects.count(object))
+      locations.objects.push_back(object);
+    else
+      locations.untracked = true;
+  }
+
+  return locationCache[pointer] = std::move(locations);
+}
+
+bool InputDependence::isTainted(const Locations &locations) const {
+  if (locations.untracked && untrackedMemoryTainted)
+    return true;
+
+  return std::any_of(
+      locations.objects.begin(), locations.objects.end(),
+      [this](const Value *object) { return taintedObjects.count(object); });
+}
+
+bool InputDependence::taint(const Locations &locations) {
+  bool changed = false;
+  if (locations.untracked && !untrackedMemoryTainted) {
+    untrackedMemoryTainted = true;
+    changed = true;
+  }
+
+  for (auto *object : locations.objects)
+    changed |= taintedObjects.insert(object).second;
+
+  return changed;
+}
+
+bool InputDependence::update(const Instruction &I) {
+  if (auto *call = dyn_cast<CallBase>(&I))
+    return updateCall(*call);
+
+  if (auto *load = dyn_cast<LoadInst>(&I)) {
+    auto *pointer = load->getPointerOperand();
+    if (isTainted(pointer) || isTainted(getLocations(pointer)))
+      return taint(load);
+    return false;
+  }
+
+  if (auto *store = dyn_cast<StoreInst>(&I)) {
+    if (isTainted(store->getValueOperand()))
+      return taint(getLocations(store->getPointerOperand()));
+    return false;
+  }
+
+  if (isa<AtomicRMWInst>(I) || isa<AtomicCmpXchgInst>(I)) {
+    auto *pointer = isa<AtomicRMWInst>(I)
+                        ? cast<AtomicRMWInst>(I).getPointerOperand()
+                        : cast<AtomicCmpXchgInst>(I).getPointerOperand();
+
+    bool changed = false;
+    if (std::any_of(I.op_begin(), I.op_end(), [&](const Use &operand) {
+          return operand.get() != pointer && isTainted(operand.get());
+        }))
+      changed |= taint(getLocations(pointer));
+    if (std::any_of(I.op_begin(), I.op_end(),
+                    [this](const Use &operand) {
+                      return isTainted(operand.get());
+                    }) ||
+        isTainted(getLocations(pointer)))
+      changed |= taint(&I);
+    return changed;
+  }
+
+  if (auto *ret = dyn_cast<ReturnInst>(&I)) {
+    auto *value = ret->getReturnValue();
+    if (value != nullptr && isTainted(value))
+      return taintedReturns.insert(ret->getFunction()).second;
+    return false;
+  }
+
+  // These read memory that we don't track: variable arguments and exception
+  // objects.
+  if (isa<VAArgInst>(I) || I.isEHPad()) {
+    if (!I.getType()->isVoidTy() &&
+        (untrackedMemoryTainted || !taintedObjects.empty()))
+      return taint(&I);
+    return false;
+  }
+
+  // Everything else computes its result from the operands.
+  if (!I.getType()->isVoidTy() &&
+      std::any_of(I.op_begin(), I.op_end(), [this](const Use &operand) {
+        return isTainted(operand.get());
+      }))
+    return taint(&I);
+
+  return false;
+}
+
+bool InputDependence::updateCall(const CallBase &call) {
+  auto *callee =
+      dyn_cast<Function>(call.getCalledOperand()->stripPointerCasts());
+  bool changed = false;
+
+  if (callee != nullptr && isAnalyzedFunction(*callee)) {
+    for (unsigned i = 0, numArgs = call.arg_size(); i < numArgs; i++) {
+      if (!isTainted(call.getArgOperand(i)))
+        continue;
+
+      if (i < callee->arg_size()) {
+        changed |= taint(callee->getArg(i));
+      } else if (!untrackedMemoryTainted) {
+        // Variable arguments are passed in memory.
+        untrackedMemoryTainted = true;
+        changed = true;
+      }
+    }
+
+    if (taintedReturns.count(callee))
+      changed |= taint(&call);
+
+    return changed;
+  }
+
+  unsigned bufferArg = 0;
+  switch (callee == nullptr ? InputFunctionKind::None
+                            : getInputFunctionKind(*callee, bufferArg)) {
+  case InputFunctionKind::Buffer:
+    changed |= taint(getLocations(call.getArgOperand(bufferArg)));
+    changed |= taint(&call);
+    return changed;
+  case InputFunctionKind::Result:
+    return taint(&call);
+  case InputFunctionKind::Mapping:
+    if (!untrackedMemoryTainted) {
+      untrackedMemoryTainted = true;
+      changed = true;
+    }
+    return changed;
+  default:
+    break;
+  }
+
+  if (auto *transfer = dyn_cast<MemTransferInst>(&call)) {
+    if (isTainted(getLocations(transfer->getRawSource())))
+      return taint(getLocations(transfer->getRawDest()));
+    return false;
+  }
+
+  if (auto *memset = dyn_cast<MemSetInst>(&call)) {
+    if (isTainted(memset->getValue()))
+      return taint(getLocations(memset->getRawDest()));
+    return false;
+  }
+
+  // Other functions outside the module may derive their results and whatever
+  // they write from their arguments and the memory that these point to,
+  // unless they are instrumented code of another translation unit. We don't
+  // know what indirect calls return.
+  bool inputDependent = callee != nullptr && opaqueFunctions.count(callee);
+  for (unsigned i = 0, numArgs = call.arg_size(); i < numArgs; i++) {
+    auto *arg = call.getArgOperand(i);
+    if (isTainted(arg) ||
+        (arg->getType()->isPointerTy() && !call.doesNotAccessMemory(i) &&
+         isTainted(getLocations(arg))))
+      inputDependent = true;
+  }
+
+  if (!call.getType()->isVoidTy() && (inputDependent || callee == nullptr))
+    changed |= taint(&call);
+
+  if (inputDependent && !call.onlyReadsMemory()) {
+    for (unsigned i = 0, numArgs = call.arg_size(); i < numArgs; i++) {
+      auto *arg = call.getArgOperand(i);
+      if (arg->getType()->isPointerTy() && !call.onlyReadsMemory(i))
+        changed |= taint(getLocations(arg));
+    }
+  }
+
+  return changed;
+}
+
+bool InputDependence::canSkip(const Instruction &I) {
+  if (isTainted(&I) ||
+      std::any_of(I.op_begin(), I.op_end(), [this](const Use &operand) {
+        return isTainted(operand.get());
+      }))
+    return false;
+
+  // Loads are tainted if they may read input-dependent data.
+  if (isa<LoadInst>(I))
+    return true;
+
+  // A store also removes whatever symbolic data was at the target address
+  // before. We can only skip it if nothing symbolic can ever have been there,
+  // which rules out memory that is reused for other data (e.g., the stack).
+  if (auto *store = dyn_cast<StoreInst>(&I)) {
+    SmallVector<const Value *, 4> objects;
+    getUnderlyingObjects(store->getPointerOperand(), objects, nullptr, 0);
+    return std::all_of(
+        objects.begin(), objects.end(), [this](const Value *object) {
+          if (!isa<GlobalVariable>(object))
+            return false;
+          return trackedObjects.count(object) ? !taintedObjects.count(object)
+                                              : !untrackedMemoryTainted;
+        });
+  }
+
+  return isa<PHINode>(I) || isa<BinaryOperator>(I) || isa<UnaryOperator>(I) ||
+         isa<CmpInst>(I) || isa<CastInst>(I) || isa<SelectInst>(I) ||
+         isa<GetElementPtrInst>(I) || isa<ExtractValueInst>(I) ||
+         isa<InsertValueInst>(I) || isa<ExtractElementInst>(I) ||
+         isa<InsertElementInst>(I) || isa<ShuffleVectorInst>(I) ||
+         isa<FreezeInst>(I) || isa<BranchInst>(I) || isa<SwitchInst>(I) ||
+         isa<IndirectBrInst>(I);
+}
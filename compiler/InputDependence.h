@@ -0,0 +1,111 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef INPUTDEPENDENCE_H
+#define INPUTDEPENDENCE_H
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/ValueMap.h>
+
+/// A whole-program analysis that finds the instructions whose symbolic
+/// expressions are always null, i.e., the ones that can't depend on data from
+/// the input functions that the run-time library intercepts (read, fread,
+/// getc, mmap, etc.).
+///
+/// The analysis is flow- and context-insensitive. Values are input-dependent
+/// if any of their operands is. Memory is modeled as the allocas and globals
+/// whose address we can follow to every access, plus a single location for
+/// everything else; a load is input-dependent if any of the locations that
+/// its pointer may refer to ever receives input-dependent data.
+///
+/// Functions that are only declared are assumed to read input exclusively
+/// through the intercepted functions if they are intrinsics or known library
+/// functions; other than that, they may return and write anything that they
+/// can derive from their arguments. Any other declared function may be
+/// instrumented code from a different translation unit, so its results and
+/// all memory that we don't track are input-dependent unless the module
+/// contains the whole program: it defines main and doesn't call any such
+/// function (e.g., when compiling with LTO).
+class InputDependence {
+public:
+  explicit InputDependence(llvm::Module &M);
+
+  /// Determine whether the instruction can be left uninstrumented because it
+  /// never sees symbolic data.
+  ///
+  /// Instructions that didn't exist at the time of the analysis are never
+  /// concrete; neither are those that the run-time library needs to see
+  /// regardless (e.g., calls and stores to memory that may be reused).
+  bool isConcrete(const llvm::Instruction &I) const {
+    return concreteInstructions.count(&I) > 0;
+  }
+
+  /// Determine whether the analysis could assume that the module contains the
+  /// whole program.
+  bool isWholeProgram() const { return wholeProgram; }
+
+private:
+  /// A set of memory locations: tracked objects, and possibly everything else.
+  struct Locations {
+    llvm::SmallVector<const llvm::Value *, 2> objects;
+    bool untracked = false;
+  };
+
+  /// Decide whether we can follow the address of the alloca or global to all
+  /// of its uses.
+  static bool isTrackable(const llvm::Value *object);
+
+  const Locations &getLocations(const llvm::Value *pointer);
+  bool isTainted(const llvm::Value *V) const { return taintedValues.count(V); }
+  bool isTainted(const Locations &locations) const;
+  bool taint(const llvm::Value *V) { return taintedValues.insert(V).second; }
+  bool taint(const Locations &locations);
+
+  /// Propagate input dependence through the instruction; return true if the
+  /// state changed.
+  bool update(const llvm::Instruction &I);
+  bool updateCall(const llvm::CallBase &call);
+
+  /// Decide whether the instruction can be left uninstrumented, given the
+  /// final state of the analysis.
+  bool canSkip(const llvm::Instruction &I);
+
+  /// The declared functions that may be instrumented code.
+  llvm::SmallPtrSet<const llvm::Function *, 16> opaqueFunctions;
+  bool wholeProgram = false;
+
+  llvm::DenseSet<const llvm::Value *> taintedValues;
+  llvm::SmallPtrSet<const llvm::Value *, 16> trackedObjects;
+  llvm::SmallPtrSet<const llvm::Value *, 16> taintedObjects;
+  bool untrackedMemoryTainted = false;
+  llvm::DenseMap<const llvm::Value *, Locations> locationCache;
+
+  /// The functions with input-dependent results.
+  llvm::SmallPtrSet<const llvm::Function *, 16> taintedReturns;
+
+  /// Don't follow RAUW: a replacement may well depend on input.
+  struct ConcreteMapConfig : llvm::ValueMapConfig<const llvm::Instruction *> {
+    enum { FollowRAUW = false };
+  };
+
+  llvm::ValueMap<const llvm::Instruction *, bool, ConcreteMapConfig>
+      concreteInstructions;
+};
+
+#endif
@@ -14,6 +14,8 @@
 
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/Scalar/GVN.h>
 
 #include "Pass.h"
 
@@ -22,10 +24,28 @@ void addSymbolizePass(const llvm::PassManagerBuilder & /* unused */,
   PM.add(new SymbolizePass());
 }
 
-// Make the pass known to opt.
+/// Add our pass followed by a few passes that clean up the code that it
+/// injects: GVN merges redundant calls to the run-time library (see the
+/// attributes in Runtime.cpp), LICM hoists loop-invariant ones, and
+/// SimplifyCFG and DCE get rid of the checks and branches that became
+/// unnecessary along the way.
+void addSymbolizeAndCleanupPasses(const llvm::PassManagerBuilder & /* unused */,
+                                  llvm::legacy::PassManagerBase &PM) {
+  PM.add(new SymbolizePass());
+  PM.add(llvm::createGVNPass());
+  PM.add(llvm::createLICMPass());
+  PM.add(llvm::createCFGSimplificationPass());
+  PM.add(llvm::createDeadCodeEliminationPass());
+}
+
+// Make the passes known to opt (and the pass manager, which schedules the
+// preparation when something requires it).
+static llvm::RegisterPass<PrepareSymbolizationPass>
+    W("symbolize-prepare", "Symbolization Preparation Pass");
 static llvm::RegisterPass<SymbolizePass> X("symbolize", "Symbolization Pass");
 // Tell frontends to run the pass automatically.
 static struct llvm::RegisterStandardPasses
-    Y(llvm::PassManagerBuilder::EP_VectorizerStart, addSymbolizePass);
+    Y(llvm::PassManagerBuilder::EP_VectorizerStart,
+      addSymbolizeAndCleanupPasses);
 static struct llvm::RegisterStandardPasses
     Z(llvm::PassManagerBuilder::EP_EnabledOnOptLevel0, addSymbolizePass);
@@ -18,8 +18,12 @@
 #include <llvm/IR/InstIterator.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Transforms/Utils/CallPromotionUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 #include <llvm/Transforms/Utils/ModuleUtils.h>
 
+#include "InputDependence.h"
 #include "Runtime.h"
 #include "Symbolizer.h"
 
@@ -34,11 +38,372 @@ using namespace llvm;
 #define DEBUG(X) ((void)0)
 #endif
 
+static cl::opt<std::string> RuntimeBitcode(
+    "symcc-runtime-bitcode",
+    cl::desc("Inline trivial helpers from this bitcode version of the "
+             "run-time library into instrumented code"),
+    cl::value_desc("file"));
+
+static cl::opt<bool> VersionLoops(
+    "symcc-version-loops",
+    cl::desc("Add an uninstrumented version of each loop that runs while the "
+             "loop only sees concrete data"));
+
+static cl::opt<bool> ConcreteFunctions(
+    "symcc-concrete-functions",
+    cl::desc("Add an uninstrumented clone of each function that only calls "
+             "functions of the same module, and run it while the program "
+             "hasn't read symbolic input"));
+
+static cl::opt<NotificationMode> Notifications(
+    "symcc-notifications",
+    cl::desc("How to tell the run-time library about calls, returns and basic "
+             "blocks (only used by QSYM's basic-block pruning)"),
+    cl::values(clEnumValN(NotificationMode::All, "all",
+                          "Call the run-time library every time"),
+               clEnumValN(NotificationMode::Needed, "needed",
+                          "Skip basic blocks that can't affect pruning"),
+               clEnumValN(NotificationMode::Buffered, "buffered",
+                          "Like needed, but record notifications in a buffer "
+                          "that the backend drains when it needs them"),
+               clEnumValN(NotificationMode::None, "none",
+                          "Don't notify the run-time library")),
+    cl::init(NotificationMode::All));
+
+static cl::opt<bool> AnalyzeInputDependence(
+    "symcc-input-dependence",
+    cl::desc("Don't instrument code that provably never sees data from the "
+             "input (most effective if the module contains the whole "
+             "program, e.g., with LTO)"));
+
+char PrepareSymbolizationPass::ID = 0;
+
+bool PrepareSymbolizationPass::runOnModule(Module &M) {
+  DEBUG(errs() << "Preparing the module for symbolization\n");
+
+  inlinableRuntimeFunctions.clear();
+  concreteFunctionClones.clear();
+
+  // We run right before SymbolizePass, so the functions that we add here
+  // aren't exposed to the rest of the optimization pipeline; in particular,
+  // available_externally helpers keep their bodies, and unused clones aren't
+  // deleted before the instrumented code calls them.
+  if (!RuntimeBitcode.empty()) {
+    importRuntimeBitcode(M, RuntimeBitcode, inlinableRuntimeFunctions);
+    for (auto *function : inlinableRuntimeFunctions)
+      function->addFnAttr(kRuntimeHelperAttr);
+  }
+
+  passExpressionsInArguments(M);
+
+  // The analysis has to see the program before we instrument anything or add
+  // clones.
+  if (AnalyzeInputDependence)
+    markInputIndependentInstructions(M);
+
+  if (ConcreteFunctions)
+    createConcreteFunctions(M);
+
+  removeMemoryAttributes(M);
+
+  return true;
+}
+
+void PrepareSymbolizationPass::markInputIndependentInstructions(Module &M) {
+  InputDependence inputDependence(M);
+  if (!inputDependence.isWholeProgram())
+    errs() << "SymCC: the module doesn't contain the whole program, so the "
+              "input-dependence analysis assumes that other code may "
+              "produce input\n";
+
+  auto *marker = MDNode::get(M.getContext(), {});
+  for (auto &function : M.functions())
+    for (auto &I : instructions(function))
+      if (inputDependence.isConcrete(I))
+        I.setMetadata(kInputIndependentMD, marker);
+}
+
+void PrepareSymbolizationPass::removeMemoryAttributes(Module &M) {
+  // Earlier optimizations may have concluded that a function doesn't access
+  // memory; this is no longer true once it calls the run-time library. The
+  // cleanup passes that run after us in the same function pass manager would
+  // otherwise merge, hoist or delete calls in callers that are cleaned up
+  // before their callees are instrumented, so we remove the attributes from
+  // all functions and calls before instrumenting anything.
+  const Attribute::AttrKind kinds[] = {
+      Attribute::ReadNone,
+      Attribute::ReadOnly,
+      Attribute::WriteOnly,
+      Attribute::ArgMemOnly,
+      Attribute::InaccessibleMemOnly,
+      Attribute::InaccessibleMemOrArgMemOnly,
+      Attribute::Speculatable};
+
+  SmallPtrSet<Function *, 32> instrumentedFunctions;
+  for (auto &function : M.functions()) {
+    if (function.isDeclaration() ||
+        function.getName() == SymbolizePass::kSymCtorName ||
+        inlinableRuntimeFunctions.count(&function) ||
+        concreteFunctionClones.count(&function))
+      continue;
+
+    instrumentedFunctions.insert(&function);
+    for (auto kind : kinds)
+      function.removeFnAttr(kind);
+  }
+
+  for (auto &function : M.functions()) {
+    for (auto &I : instructions(function)) {
+      auto *call = dyn_cast<CallBase>(&I);
+      if (call == nullptr ||
+          !instrumentedFunctions.count(dyn_cast<Function>(
+              call->getCalledOperand()->stripPointerCasts())))
+        continue;
+
+      for (auto kind : kinds)
+#if LLVM_VERSION_MAJOR >= 14
+        call->removeFnAttr(kind);
+#else
+        call->removeAttribute(AttributeList::FunctionIndex, kind);
+#endif
+    }
+  }
+}
+
+void PrepareSymbolizationPass::passExpressionsInArguments(Module &M) {
+  // We can only change the signature of functions whose callers we know, so
+  // we require local linkage and no uses other than direct calls.
+  SmallVector<Function *, 16> functions;
+  for (auto &function : M.functions()) {
+    if (function.isDeclaration() ||
+        !function.hasLocalLinkage() || function.isVarArg() ||
+        function.hasFnAttribute(Attribute::Naked) ||
+        inlinableRuntimeFunctions.count(&function) ||
+        (function.arg_empty() && function.getReturnType()->isVoidTy()))
+      continue;
+
+    bool onlyDirectCalls = all_of(function.uses(), [&function](const Use &use) {
+      auto *call = dyn_cast<CallBase>(use.getUser());
+      return call != nullptr && (isa<CallInst>(call) || isa<InvokeInst>(call)) &&
+             call->isCallee(&use) &&
+             call->getFunctionType() == function.getFunctionType() &&
+             !(isa<CallInst>(call) && cast<CallInst>(call)->isMustTailCall());
+    });
+    bool hasMustTailCalls = any_of(instructions(function), [](Instruction &I) {
+      auto *call = dyn_cast<CallInst>(&I);
+      return call != nullptr && call->isMustTailCall();
+    });
+    if (onlyDirectCalls && !hasMustTailCalls)
+      functions.push_back(&function);
+  }
+
+  auto &context = M.getContext();
+  auto *exprType = Type::getInt8PtrTy(context);
+  auto *nullExpression = ConstantPointerNull::get(exprType);
+  auto *marker = MDNode::get(context, {});
+
+  for (auto *function : functions) {
+    // The new function takes an expression for each parameter after the
+    // regular parameters, and it returns the expression of the result along
+    // with the value.
+    auto *oldType = function->getFunctionType();
+    auto numParams = oldType->getNumParams();
+    SmallVector<Type *, 8> paramTypes(oldType->param_begin(),
+                                      oldType->param_end());
+    paramTypes.append(numParams, exprType);
+    bool returnsValue = !oldType->getReturnType()->isVoidTy();
+    auto *returnType =
+        returnsValue ? StructType::get(oldType->getReturnType(), exprType)
+                     : oldType->getReturnType();
+    auto *newType = FunctionType::get(returnType, paramTypes, false);
+
+    auto *newFunction = Function::Create(newType, function->getLinkage(),
+                                         function->getAddressSpace());
+    M.getFunctionList().insert(function->getIterator(), newFunction);
+    newFunction->copyAttributesFrom(function);
+    newFunction->setComdat(function->getComdat());
+    newFunction->copyMetadata(function, 0);
+    newFunction->takeName(function);
+
+    // Attributes of the return value don't apply to the pair, and neither
+    // does "returned" on a parameter (which optimizations infer for functions
+    // that return one of their arguments).
+    auto adaptAttributes = [&](AttributeList attributes) {
+      if (!returnsValue)
+        return attributes;
+
+#if LLVM_VERSION_MAJOR >= 14
+      attributes = attributes.removeAttributesAtIndex(
+          context, AttributeList::ReturnIndex);
+#else
+      attributes =
+          attributes.removeAttributes(context, AttributeList::ReturnIndex);
+#endif
+      for (unsigned argNo = 0; argNo < numParams; argNo++)
+        attributes = attributes.removeParamAttribute(context, argNo,
+                                                     Attribute::Returned);
+      return attributes;
+    };
+    newFunction->setAttributes(adaptAttributes(function->getAttributes()));
+
+    newFunction->getBasicBlockList().splice(newFunction->begin(),
+                                            function->getBasicBlockList());
+    auto newArg = newFunction->arg_begin();
+    for (auto &arg : function->args()) {
+      arg.replaceAllUsesWith(&*newArg);
+      newArg->takeName(&arg);
+      if (newArg->hasName())
+        newFunction->getArg(numParams + arg.getArgNo())
+            ->setName(newArg->getName() + ".expr");
+      ++newArg;
+    }
+
+    // The expressions of return values are filled in during instrumentation;
+    // for now, all results are concrete. We mark the pairs for
+    // Symbolizer::visitReturnInst, and we don't let IRBuilder fold them into
+    // constants because the expression of a constant isn't necessarily null.
+    if (returnsValue) {
+      SmallVector<ReturnInst *, 4> returns;
+      for (auto &I : instructions(newFunction))
+        if (auto *ret = dyn_cast<ReturnInst>(&I))
+          returns.push_back(ret);
+
+      for (auto *ret : returns) {
+        auto *value = InsertValueInst::Create(
+            UndefValue::get(returnType), ret->getReturnValue(), 0, "", ret);
+        auto *result =
+            InsertValueInst::Create(value, nullExpression, 1, "", ret);
+        value->setMetadata(kReturnPairMD, marker);
+        result->setMetadata(kReturnPairMD, marker);
+        ReturnInst::Create(context, result, ret);
+        ret->eraseFromParent();
+      }
+    }
+
+    // Likewise, callers pass null expressions until they're instrumented.
+    for (auto *user : SmallVector<User *, 8>(function->users())) {
+      auto *call = cast<CallBase>(user);
+      SmallVector<Value *, 8> args(call->arg_begin(), call->arg_end());
+      args.append(numParams, nullExpression);
+      SmallVector<OperandBundleDef, 1> bundles;
+      call->getOperandBundlesAsDefs(bundles);
+
+      bool needsResult = returnsValue && !call->use_empty();
+      CallBase *newCall;
+      Instruction *resultInsertionPoint = nullptr;
+      if (auto *invoke = dyn_cast<InvokeInst>(call)) {
+        // The result is only available on the normal edge, so extract it in a
+        // block of its own.
+        auto *normalDest = invoke->getNormalDest();
+        if (needsResult) {
+          auto *edge = BasicBlock::Create(context, "", invoke->getFunction(),
+                                          normalDest);
+          resultInsertionPoint = BranchInst::Create(normalDest, edge);
+          normalDest->replacePhiUsesWith(invoke->getParent(), edge);
+          normalDest = edge;
+        }
+        newCall = InvokeInst::Create(newFunction, normalDest,
+                                     invoke->getUnwindDest(), args, bundles, "",
+                                     invoke);
+      } else {
+        newCall = CallInst::Create(newFunction, args, bundles, "", call);
+        cast<CallInst>(newCall)->setTailCallKind(
+            cast<CallInst>(call)->getTailCallKind());
+        resultInsertionPoint = call->getNextNode();
+      }
+
+      newCall->setCallingConv(call->getCallingConv());
+      newCall->setAttributes(adaptAttributes(call->getAttributes()));
+      newCall->setDebugLoc(call->getDebugLoc());
+
+      if (needsResult) {
+        auto *result =
+            ExtractValueInst::Create(newCall, 0, "", resultInsertionPoint);
+        result->setDebugLoc(call->getDebugLoc());
+        result->setMetadata(kCallResultMD, marker);
+        call->replaceAllUsesWith(result);
+        result->takeName(call);
+      }
+      call->eraseFromParent();
+    }
+
+    function->eraseFromParent();
+    newFunction->addFnAttr(kExpressionPassingAttr);
+  }
+}
+
+void PrepareSymbolizationPass::createConcreteFunctions(Module &M) {
+  // Start with all functions that we're going to instrument, and drop those
+  // that call anything else until nothing changes. Calls among the remaining
+  // functions (including recursive ones) are fine because the clones call
+  // each other.
+  SmallPtrSet<Function *, 32> candidates;
+  for (auto &function : M.functions()) {
+    if (!function.isDeclaration() && !function.isVarArg() &&
+        !function.hasAvailableExternallyLinkage() &&
+        !inlinableRuntimeFunctions.count(&function))
+      candidates.insert(&function);
+  }
+
+  auto callsOnlyCandidates = [&candidates](Function &function) {
+    for (auto &I : instructions(function)) {
+      auto *call = dyn_cast<CallBase>(&I);
+      if (call == nullptr || isConcreteIntrinsicCall(*call))
+        continue;
+      if (!isa<CallInst>(call) || !candidates.count(call->getCalledFunction()))
+        return false;
+    }
+    return true;
+  };
+
+  bool changed;
+  do {
+    changed = false;
+    for (auto *function : SmallVector<Function *, 32>(candidates.begin(),
+                                                       candidates.end())) {
+      if (!callsOnlyCandidates(*function)) {
+        candidates.erase(function);
+        changed = true;
+      }
+    }
+  } while (changed);
+
+  DenseMap<Function *, Function *> concreteFunctions;
+  for (auto *function : candidates) {
+    ValueToValueMapTy valueMap;
+    auto *clone = CloneFunction(function, valueMap);
+    clone->setName(function->getName() + ".concrete");
+    clone->setLinkage(GlobalValue::InternalLinkage);
+    clone->setComdat(nullptr);
+    clone->addFnAttr(kConcreteCloneAttr);
+    function->addFnAttr(kConcreteVersionAttr, clone->getName());
+    concreteFunctions[function] = clone;
+    concreteFunctionClones.insert(clone);
+  }
+
+  for (auto *clone : concreteFunctionClones) {
+    for (auto &I : instructions(*clone)) {
+      if (auto *call = dyn_cast<CallInst>(&I)) {
+        auto cloneIt = concreteFunctions.find(call->getCalledFunction());
+        if (cloneIt != concreteFunctions.end())
+          call->setCalledFunction(cloneIt->second);
+      }
+    }
+  }
+}
+
 char SymbolizePass::ID = 0;
 
+void SymbolizePass::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<PrepareSymbolizationPass>();
+}
+
 bool SymbolizePass::doInitialization(Module &M) {
   DEBUG(errs() << "Symbolizer module init\n");
 
+  visitedInstructions = 0;
+  concreteInstructions = 0;
+
   // Redirect calls to external functions to the corresponding wrappers and
   // rename internal functions.
   for (auto &function : M.functions()) {
@@ -52,34 +417,101 @@ bool SymbolizePass::doInitialization(Module &M) {
   std::tie(ctor, std::ignore) = createSanitizerCtorAndInitFunctions(
       M, kSymCtorName, "_sym_initialize", {}, {});
   appendToGlobalCtors(M, ctor, 0);
+  constantExpressions.reset(ctor);
 
   return true;
 }
 
 bool SymbolizePass::runOnFunction(Function &F) {
   auto functionName = F.getName();
-  if (functionName == kSymCtorName)
+  if (functionName == kSymCtorName ||
+      F.hasFnAttribute(PrepareSymbolizationPass::kRuntimeHelperAttr) ||
+      F.hasFnAttribute(PrepareSymbolizationPass::kConcreteCloneAttr))
     return false;
 
   DEBUG(errs() << "Symbolizing function ");
   DEBUG(errs().write_escaped(functionName) << '\n');
 
+  Symbolizer symbolizer(*F.getParent(), constantExpressions, Notifications);
+  auto concreteVersion =
+      F.getFnAttribute(PrepareSymbolizationPass::kConcreteVersionAttr);
+  if (concreteVersion.isValid()) {
+    symbolizer.addConcreteDispatch(
+        F, *F.getParent()->getFunction(concreteVersion.getValueAsString()));
+    F.removeFnAttr(PrepareSymbolizationPass::kConcreteVersionAttr);
+  }
+  if (VersionLoops)
+    symbolizer.versionLoops(F);
+
   SmallVector<Instruction *, 0> allInstructions;
   allInstructions.reserve(F.getInstructionCount());
-  for (auto &I : instructions(F))
-    allInstructions.push_back(&I);
+  for (auto &basicBlock : F) {
+    if (symbolizer.isConcreteBlock(basicBlock))
+      continue;
+    for (auto &I : basicBlock) {
+      visitedInstructions++;
+      if (I.getMetadata(PrepareSymbolizationPass::kInputIndependentMD)) {
+        I.setMetadata(PrepareSymbolizationPass::kInputIndependentMD, nullptr);
+        concreteInstructions++;
+        continue;
+      }
+      allInstructions.push_back(&I);
+    }
+  }
 
-  Symbolizer symbolizer(*F.getParent());
   symbolizer.symbolizeFunctionArguments(F);
 
-  for (auto &basicBlock : F)
-    symbolizer.insertBasicBlockNotification(basicBlock);
+  for (auto &basicBlock : F) {
+    if (!symbolizer.isConcreteBlock(basicBlock))
+      symbolizer.insertBasicBlockNotification(basicBlock);
+  }
+
+  symbolizer.insertGarbageCollectionSafePoints(F);
 
   for (auto *instPtr : allInstructions)
     symbolizer.visit(instPtr);
 
+  symbolizer.finalizeConcreteVersions();
   symbolizer.finalizePHINodes();
   symbolizer.shortCircuitExpressionUses();
+  symbolizer.finalizeNotifications();
+
+  if (!RuntimeBitcode.empty()) {
+    // The bitcode usually has more specific types than our declarations
+    // (e.g., pointers to the backend's expressions instead of i8*), so calls
+    // go through a cast that we need to remove before inlining.
+    auto getRuntimeFunction = [](CallInst *call) -> Function * {
+      auto *callee =
+          dyn_cast<Function>(call->getCalledOperand()->stripPointerCasts());
+      return (callee != nullptr &&
+              callee->hasFnAttribute(
+                  PrepareSymbolizationPass::kRuntimeHelperAttr))
+                 ? callee
+                 : nullptr;
+    };
+
+    SmallVector<CallInst *, 0> runtimeCalls;
+    for (auto &I : instructions(F))
+      if (auto *call = dyn_cast<CallInst>(&I))
+        if (getRuntimeFunction(call) != nullptr)
+          runtimeCalls.push_back(call);
+
+    for (auto *call : runtimeCalls) {
+      if (call->getCalledFunction() == nullptr)
+#if LLVM_VERSION_MAJOR >= 11
+        promoteCall(*call, getRuntimeFunction(call));
+#else
+        promoteCall(call, getRuntimeFunction(call));
+#endif
+
+      InlineFunctionInfo inlineInfo;
+#if LLVM_VERSION_MAJOR >= 11
+      InlineFunction(*call, inlineInfo);
+#else
+      InlineFunction(call, inlineInfo);
+#endif
+    }
+  }
 
   // DEBUG(errs() << F << '\n');
   assert(!verifyFunction(F, &errs()) &&
@@ -87,3 +519,13 @@ bool SymbolizePass::runOnFunction(Function &F) {
 
   return true;
 }
+
+bool SymbolizePass::doFinalization(Module & /*unused*/) {
+  if (AnalyzeInputDependence)
+    errs() << "SymCC: " << concreteInstructions << " of "
+           << visitedInstructions
+           << " instructions don't depend on input and were left "
+              "uninstrumented\n";
+
+  return false;
+}
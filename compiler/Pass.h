@@ -15,25 +15,97 @@
 #ifndef PASS_H
 #define PASS_H
 
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/Constant.h>
 #include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/ValueMap.h>
 #include <llvm/Pass.h>
 
+#include "Symbolizer.h"
+
+/// Prepare a module for SymbolizePass, which requires this pass and thus
+/// makes the pass manager run it first.
+///
+/// Some of the preparations change functions other than the one being
+/// instrumented, which a function pass must not do. The results reach
+/// SymbolizePass through the IR: the function attributes and metadata below,
+/// and kExpressionPassingAttr (see Symbolizer.h). SymbolizePass removes most
+/// markers once it has used them; the others don't affect code generation.
+class PrepareSymbolizationPass : public llvm::ModulePass {
+public:
+  static char ID;
+
+  /// The attribute of run-time helpers that we imported from bitcode in order
+  /// to inline them into instrumented code.
+  static constexpr char kRuntimeHelperAttr[] = "symcc-runtime-helper";
+
+  /// The attribute of functions with an uninstrumented clone; its value is
+  /// the name of the clone.
+  static constexpr char kConcreteVersionAttr[] = "symcc-concrete-version";
+
+  /// The attribute of the uninstrumented clones themselves.
+  static constexpr char kConcreteCloneAttr[] = "symcc-concrete-clone";
+
+  /// The metadata of instructions that the input-dependence analysis found to
+  /// be concrete.
+  static constexpr char kInputIndependentMD[] = "symcc.input_independent";
+
+  PrepareSymbolizationPass() : ModulePass(ID) {}
+
+  bool runOnModule(llvm::Module &M) override;
+
+private:
+  /// Give each internal function an additional parameter for the symbolic
+  /// expression of each regular parameter, and make it return the expression
+  /// of its result together with the value. Calls between instrumented
+  /// functions thus pass expressions in registers rather than through the
+  /// run-time library. This only works for functions whose callers are all
+  /// known; everything else keeps using the run-time library.
+  void passExpressionsInArguments(llvm::Module &M);
+
+  /// Remove the attributes that claim that functions don't access memory from
+  /// all functions that we're going to instrument and from calls to them.
+  void removeMemoryAttributes(llvm::Module &M);
+
+  /// Create an uninstrumented clone of every function that only calls
+  /// functions of the module (which have clones, too) and safe intrinsics.
+  void createConcreteFunctions(llvm::Module &M);
+
+  /// Run the input-dependence analysis and mark the concrete instructions.
+  void markInputIndependentInstructions(llvm::Module &M);
+
+  /// The run-time helpers that we imported from bitcode.
+  llvm::SmallPtrSet<llvm::Function *, 16> inlinableRuntimeFunctions;
+
+  /// The uninstrumented clones of functions.
+  llvm::SmallPtrSet<llvm::Function *, 16> concreteFunctionClones;
+};
+
 class SymbolizePass : public llvm::FunctionPass {
 public:
   static char ID;
 
+  static constexpr char kSymCtorName[] = "__sym_ctor";
+
   SymbolizePass() : FunctionPass(ID) {}
 
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
   bool doInitialization(llvm::Module &M) override;
   bool runOnFunction(llvm::Function &F) override;
+  bool doFinalization(llvm::Module &M) override;
 
 private:
-  static constexpr char kSymCtorName[] = "__sym_ctor";
-
   /// Mapping from global variables to their corresponding symbolic expressions.
   llvm::ValueMap<llvm::GlobalVariable *, llvm::GlobalVariable *>
       globalExpressions;
+
+  /// The slots that cache the symbolic expressions of compile-time constants
+  /// in the current module (see Symbolizer).
+  ConstantExpressionCache constantExpressions;
+
+  /// The number of instructions that we visited and that we left
+  /// uninstrumented because of the input-dependence analysis.
+  size_t visitedInstructions = 0, concreteInstructions = 0;
 };
 
 #endif
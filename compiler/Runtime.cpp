@@ -17,6 +17,10 @@
 #include <llvm/ADT/StringSet.h>
 #include <llvm/Config/llvm-config.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Transforms/Utils/Cloning.h>
 
 using namespace llvm;
 
@@ -32,6 +36,82 @@ SymFnT import(llvm::Module &M, llvm::StringRef name, llvm::Type *ret,
 #endif
 }
 
+/// Decide whether a function from the run-time library's bitcode can be copied
+/// into instrumented code, collecting the globals that it references.
+///
+/// We only accept leaf functions that touch nothing but state exported by the
+/// shared library: the copy has to work on the same data as the original, and
+/// anything it calls would need instrumentation-free copies of its own.
+bool isInlinableRuntimeFunction(const Function &f,
+                                SmallPtrSetImpl<GlobalValue *> &globals) {
+  if (f.isDeclaration() || f.hasLocalLinkage() ||
+      !f.getName().startswith("_sym_"))
+    return false;
+
+  SmallVector<Constant *, 8> worklist;
+  for (const auto &I : instructions(f)) {
+    if (const auto *call = dyn_cast<CallBase>(&I)) {
+      auto *callee = call->getCalledFunction();
+      if (callee == nullptr || !callee->isIntrinsic())
+        return false;
+    }
+
+    for (const auto &operand : I.operands())
+      if (auto *constant = dyn_cast<Constant>(operand))
+        worklist.push_back(constant);
+  }
+
+  SmallPtrSet<Constant *, 8> visited;
+  while (!worklist.empty()) {
+    auto *constant = worklist.pop_back_val();
+    if (!visited.insert(constant).second)
+      continue;
+
+    if (auto *global = dyn_cast<GlobalValue>(constant)) {
+      if (auto *function = dyn_cast<Function>(global)) {
+        if (!function->isIntrinsic())
+          return false;
+      } else if (!isa<GlobalVariable>(global) || global->hasLocalLinkage() ||
+                 !global->hasDefaultVisibility()) {
+        return false;
+      }
+
+      globals.insert(global);
+      continue;
+    }
+
+    for (auto &operand : constant->operands())
+      worklist.push_back(cast<Constant>(operand));
+  }
+
+  return true;
+}
+
+/// Find or declare the counterpart of a global from the run-time library's
+/// bitcode in the given module.
+Constant *getLocalDeclaration(Module &M, GlobalValue *global) {
+  if (auto *function = dyn_cast<Function>(global)) {
+    if (auto *local = M.getFunction(function->getName()))
+      return local;
+
+    auto *local = Function::Create(function->getFunctionType(),
+                                   GlobalValue::ExternalLinkage,
+                                   function->getName(), &M);
+    local->copyAttributesFrom(function);
+    return local;
+  }
+
+  auto *variable = cast<GlobalVariable>(global);
+  auto *local = M.getNamedGlobal(variable->getName());
+  if (local == nullptr)
+    local = new GlobalVariable(M, variable->getValueType(),
+                               variable->isConstant(),
+                               GlobalValue::ExternalLinkage, nullptr,
+                               variable->getName(), nullptr,
+                               variable->getThreadLocalMode());
+  return ConstantExpr::getPointerCast(local, variable->getType());
+}
+
 } // namespace
 
 Runtime::Runtime(Module &M) {
@@ -155,6 +235,58 @@ Runtime::Runtime(Module &M) {
   notifyCall = import(M, "_sym_notify_call", voidT, intPtrType);
   notifyRet = import(M, "_sym_notify_ret", voidT, intPtrType);
   notifyBasicBlock = import(M, "_sym_notify_basic_block", voidT, intPtrType);
+  flushNotifications = import(M, "_sym_flush_notifications", voidT);
+  registerExpressionRegion = import(M, "_sym_register_expression_region", voidT,
+                                    PointerType::getUnqual(ptrT), intPtrType);
+  collectGarbage = import(M, "_sym_collect_garbage", voidT);
+
+  // On 64-bit systems, user-space addresses fit into 48 bits.
+  auto ptrBits = M.getDataLayout().getPointerSizeInBits();
+  shadowPageTableLevels = (ptrBits == 64) ? 3 : 2;
+  shadowPageTableBits =
+      ((ptrBits == 64 ? 48 : 32) - kShadowPageBits) / shadowPageTableLevels;
+  shadowPageTable = M.getOrInsertGlobal(
+      "g_shadow_pages", ArrayType::get(ptrT, 1 << shadowPageTableBits));
+  shadowedPages = M.getOrInsertGlobal("g_shadowed_pages", intPtrType);
+
+  notificationBuffer = M.getOrInsertGlobal(
+      "g_notification_buffer",
+      ArrayType::get(intPtrType, kNotificationBufferSize));
+  notificationCount = M.getOrInsertGlobal("g_notification_count", intPtrType);
+  for (auto *global : {notificationBuffer, notificationCount})
+    if (auto *variable = dyn_cast<GlobalVariable>(global))
+      variable->setThreadLocalMode(GlobalValue::InitialExecTLSModel);
+
+  // Tell the optimizer what it may assume about the run-time library, so that
+  // the cleanup passes after our pass (see Main.cpp) can merge, hoist and
+  // delete calls. As far as the instrumented program can tell, expression
+  // builders compute their result from the arguments alone (the expressions
+  // that they allocate are invisible to it), and the parameter accessor and
+  // the memory reads only look at run-time state. Moving calls around is
+  // fine with the garbage collector because it scans the stack for live
+  // expressions. Builders and memory reads may pass buffered call-stack
+  // notifications on to the backend, but they never change the buffer or its
+  // count (see g_processed_notifications in the run-time library).
+  for (auto &function : M.functions()) {
+    auto name = function.getName();
+    if (!name.startswith("_sym_") ||
+        !(function.isDeclaration() || function.hasAvailableExternallyLinkage()))
+      continue;
+
+    function.setDoesNotThrow();
+    if (name.startswith("_sym_build_")) {
+      function.setDoesNotAccessMemory();
+    } else if (name == "_sym_get_parameter_expression" ||
+               name == "_sym_read_memory") {
+      function.setOnlyReadsMemory();
+    } else {
+      continue;
+    }
+
+#if LLVM_VERSION_MAJOR >= 11
+    function.addFnAttr(Attribute::WillReturn);
+#endif
+  }
 }
 
 /// Decide whether a function is called symbolically.
@@ -163,7 +295,69 @@ bool isInterceptedFunction(const Function &f) {
       "malloc",   "calloc",  "mmap",    "mmap64", "open",   "read",    "lseek",
       "lseek64",  "fopen",   "fopen64", "fread",  "fseek",  "fseeko",  "rewind",
       "fseeko64", "getc",    "ungetc",  "memcpy", "memset", "strncpy", "strchr",
-      "memcmp",   "memmove", "ntohl",   "fgets",  "fgetc", "getchar"};
+      "memcmp",   "memmove", "ntohl",   "fgets",  "fgetc",  "getchar", "free",
+      "munmap"};
 
   return (kInterceptedFunctions.count(f.getName()) > 0);
 }
+
+void importRuntimeBitcode(Module &M, StringRef path,
+                          SmallPtrSetImpl<Function *> &imported) {
+  SMDiagnostic error;
+  auto runtimeModule = parseIRFile(path, error, M.getContext());
+  if (!runtimeModule) {
+    error.print("SymCC", errs());
+    report_fatal_error("Failed to load the bitcode of the run-time library");
+  }
+
+  if (runtimeModule->getDataLayout() != M.getDataLayout()) {
+    errs() << "Warning: the bitcode of the run-time library in " << path
+           << " was compiled for a different target; not inlining any "
+              "run-time helpers\n";
+    return;
+  }
+
+  for (auto &runtimeFunction : *runtimeModule) {
+    SmallPtrSet<GlobalValue *, 4> globals;
+    if (!isInlinableRuntimeFunction(runtimeFunction, globals))
+      continue;
+
+    // Don't touch functions that the module defines itself or declares with a
+    // different type.
+    auto *function = M.getFunction(runtimeFunction.getName());
+    if (function == nullptr)
+      function = Function::Create(runtimeFunction.getFunctionType(),
+                                  GlobalValue::ExternalLinkage,
+                                  runtimeFunction.getName(), &M);
+    else if (!function->isDeclaration() ||
+             function->getFunctionType() != runtimeFunction.getFunctionType())
+      continue;
+
+    ValueToValueMapTy valueMap;
+    for (auto *global : globals)
+      valueMap[global] = getLocalDeclaration(M, global);
+    auto localArg = function->arg_begin();
+    for (auto &arg : runtimeFunction.args())
+      valueMap[&arg] = &*localArg++;
+
+    SmallVector<ReturnInst *, 1> returns;
+#if LLVM_VERSION_MAJOR >= 13
+    CloneFunctionInto(function, &runtimeFunction, valueMap,
+                      CloneFunctionChangeType::DifferentModule, returns);
+#else
+    CloneFunctionInto(function, &runtimeFunction, valueMap,
+                      /* ModuleLevelChanges */ true, returns);
+#endif
+    function->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    function->setDSOLocal(false);
+    function->setComdat(nullptr);
+    imported.insert(function);
+  }
+
+  // Cloning into a different module creates the list of compile units even
+  // if the bitcode has no debug information; an empty list without a debug
+  // info version makes later stages complain about invalid debug info.
+  auto *compileUnits = M.getNamedMetadata("llvm.dbg.cu");
+  if (compileUnits != nullptr && compileUnits->getNumOperands() == 0)
+    M.eraseNamedMetadata(compileUnits);
+}
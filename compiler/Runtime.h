@@ -15,6 +15,7 @@
 #ifndef RUNTIME_H
 #define RUNTIME_H
 
+#include <llvm/ADT/SmallPtrSet.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/Module.h>
 
@@ -65,6 +66,48 @@ struct Runtime {
   SymFnT notifyCall{};
   SymFnT notifyRet{};
   SymFnT notifyBasicBlock{};
+  SymFnT flushNotifications{};
+  SymFnT registerExpressionRegion{};
+  SymFnT collectGarbage{};
+
+  /// The root of the run-time library's shadow page table.
+  ///
+  /// Instrumented code walks the table to find out whether memory is concrete
+  /// without calling into the run-time library. The layout has to match the
+  /// one in runtime/Shadow.h.
+  llvm::Constant *shadowPageTable{};
+
+  /// The run-time library's count of shadowed pages (an integer as wide as a
+  /// pointer). If it's zero, all memory is concrete.
+  llvm::Constant *shadowedPages{};
+
+  /// The thread-local buffer where instrumented code records notifications
+  /// instead of calling notifyCall, notifyRet and notifyBasicBlock, and the
+  /// number of entries in it (an integer as wide as a pointer). Each entry is a
+  /// site ID with one of the notification kinds below in the two least
+  /// significant bits. The layout has to match the one in
+  /// runtime/RuntimeCommon.cpp, and the kinds the ones in runtime/Threads.h.
+  llvm::Constant *notificationBuffer{};
+  llvm::Constant *notificationCount{};
+
+  /// The capacity of the notification buffer.
+  static constexpr unsigned kNotificationBufferSize = 1024;
+
+  enum NotificationKind : unsigned {
+    kBasicBlockNotification = 0,
+    kCallNotification = 1,
+    kReturnNotification = 2
+  };
+
+  /// The number of address bits covered by each shadow page.
+  static constexpr unsigned kShadowPageBits = 12;
+
+  /// The number of levels of the shadow page table.
+  unsigned shadowPageTableLevels{};
+
+  /// The number of address bits used to index each level of the shadow page
+  /// table.
+  unsigned shadowPageTableBits{};
 
   /// Mapping from icmp predicates to the functions that build the corresponding
   /// symbolic expressions.
@@ -79,4 +122,12 @@ struct Runtime {
 
 bool isInterceptedFunction(const llvm::Function &f);
 
+/// Copy the trivial helpers from the bitcode version of the run-time library
+/// (see RUNTIME_BITCODE in docs/Configuration.txt) into the module, so that
+/// calls to them can be inlined. The copies are available_externally, so
+/// whatever isn't inlined still calls the shared library. Imported functions
+/// are added to the given set.
+void importRuntimeBitcode(llvm::Module &M, llvm::StringRef path,
+                          llvm::SmallPtrSetImpl<llvm::Function *> &imported);
+
 #endif
@@ -15,21 +15,336 @@
 #include "Symbolizer.h"
 
 #include <cstdint>
+#include <llvm/ADT/SetVector.h>
 #include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/LoopInfo.h>
+#include <llvm/Analysis/ValueTracking.h>
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/GetElementPtrTypeIterator.h>
 #include <llvm/IR/Intrinsics.h>
 #include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/LoopSimplify.h>
+#include <llvm/Transforms/Utils/LoopUtils.h>
+#include <llvm/Transforms/Utils/SSAUpdater.h>
 
 #include "Runtime.h"
 
 using namespace llvm;
 
+namespace {
+
+/// Decide whether we can create a concrete version of the loop.
+///
+/// The concrete version handles memory accesses by checking the shadow, but it
+/// can't call other functions because they would expect parameter expressions.
+bool isVersionableLoop(const Loop &L) {
+  if (!L.isLoopSimplifyForm())
+    return false;
+
+  for (auto *block : L.blocks()) {
+    if (block->hasAddressTaken() || block->isEHPad())
+      return false;
+
+    for (auto &I : *block) {
+      if (isa<IndirectBrInst>(I))
+        return false;
+
+      auto *call = dyn_cast<CallBase>(&I);
+      if (call == nullptr)
+        continue;
+
+      if (!isConcreteIntrinsicCall(*call))
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/// Find the outermost loops that we can create concrete versions of.
+void collectVersionableLoops(Loop *L, SmallVectorImpl<BasicBlock *> &headers) {
+  if (isVersionableLoop(*L)) {
+    headers.push_back(L->getHeader());
+    return;
+  }
+
+  for (auto *subLoop : *L)
+    collectVersionableLoops(subLoop, headers);
+}
+
+/// Decide whether instrumented code in the basic block may call into the
+/// backend, directly or through other functions.
+///
+/// QSYM's pruning only looks at the most recent basic-block notification when
+/// the backend builds an expression, so the notification of a block that
+/// doesn't do anything is overwritten before anyone sees it. Blocks that return
+/// always count because the caller continues with their notification.
+bool mayCallBackend(const BasicBlock &B) {
+  for (const auto &I : B) {
+    if (isa<PHINode>(I) || isa<AllocaInst>(I) || isa<DbgInfoIntrinsic>(I))
+      continue;
+
+    auto *branch = dyn_cast<BranchInst>(&I);
+    if (branch == nullptr || branch->isConditional())
+      return true;
+  }
+
+  return false;
+}
+
+} // namespace
+
+bool isConcreteIntrinsicCall(const CallBase &call) {
+  auto *callee = call.getCalledFunction();
+  if (callee == nullptr)
+    return false;
+
+  switch (callee->getIntrinsicID()) {
+  case Intrinsic::lifetime_start:
+  case Intrinsic::lifetime_end:
+  case Intrinsic::dbg_declare:
+  case Intrinsic::dbg_value:
+  case Intrinsic::is_constant:
+  case Intrinsic::trap:
+  case Intrinsic::assume:
+  case Intrinsic::expect:
+  case Intrinsic::fabs:
+  case Intrinsic::cttz:
+  case Intrinsic::ctpop:
+  case Intrinsic::ctlz:
+  case Intrinsic::bswap:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void Symbolizer::versionLoops(Function &F) {
+  SmallVector<BasicBlock *, 8> headers;
+  {
+    // The optimizer doesn't keep loops in simplified form, but versioning
+    // needs a preheader to dispatch from and dedicated exit blocks.
+    DominatorTree dominatorTree(F);
+    LoopInfo loopInfo(dominatorTree);
+    for (auto *loop : loopInfo)
+      simplifyLoop(loop, &dominatorTree, &loopInfo, nullptr, nullptr, nullptr,
+                   /* PreserveLCSSA */ false);
+    for (auto *loop : loopInfo)
+      collectVersionableLoops(loop, headers);
+  }
+
+  // Versioning a loop changes the control-flow graph, so we recompute the
+  // analyses for each one. The loops are disjoint, so their headers stay the
+  // same.
+  for (auto *header : headers) {
+    DominatorTree dominatorTree(F);
+    LoopInfo loopInfo(dominatorTree);
+    auto *loop = loopInfo.getLoopFor(header);
+    assert(loop != nullptr && loop->getHeader() == header &&
+           "Versioning a loop destroyed another one");
+    versionLoop(*loop, dominatorTree, loopInfo);
+  }
+}
+
+void Symbolizer::versionLoop(Loop &L, DominatorTree &dominatorTree,
+                             LoopInfo &loopInfo) {
+  auto &F = *L.getHeader()->getParent();
+
+  // Values that are used outside the loop need to go through PHI nodes in the
+  // exit blocks, where we can merge the values from both versions.
+  formLCSSA(L, dominatorTree, &loopInfo, nullptr);
+
+  // Make each memory access start a basic block, so that the concrete version
+  // can jump to it in the instrumented loop. The target must not be the loop
+  // header (or we'd have two entries to the loop) or contain PHI nodes (which
+  // would need incoming values from the concrete version).
+  SmallVector<Instruction *, 16> memoryAccesses;
+  for (auto *block : L.blocks()) {
+    for (auto &I : *block) {
+      if (isa<LoadInst>(I) || isa<StoreInst>(I))
+        memoryAccesses.push_back(&I);
+    }
+  }
+
+  for (auto *access : memoryAccesses) {
+    auto *block = access->getParent();
+    if (access != &block->front() || block == L.getHeader())
+      SplitBlock(block, access, &dominatorTree, &loopInfo);
+  }
+
+  SmallSetVector<Value *, 8> liveIns;
+  SmallVector<Instruction *, 32> loopInstructions;
+  for (auto *block : L.blocks()) {
+    for (auto &I : *block) {
+      loopInstructions.push_back(&I);
+      for (auto *operand : I.operand_values()) {
+        if (isa<Argument>(operand) ||
+            (isa<Instruction>(operand) &&
+             !L.contains(cast<Instruction>(operand))))
+          liveIns.insert(operand);
+      }
+    }
+  }
+
+  SmallVector<BasicBlock *, 4> exitBlocks;
+  L.getUniqueExitBlocks(exitBlocks);
+
+  for (auto *loop : L.getLoopsInPreorder())
+    versionedLoopHeaders.push_back(loop->getHeader());
+
+  // Clone the loop with a new preheader, and let the old preheader decide
+  // which version to run. Every block created from here on belongs to the
+  // concrete version.
+  auto *dispatchBlock = L.getLoopPreheader();
+  auto *instrumentedPreheader = SplitBlock(
+      dispatchBlock, dispatchBlock->getTerminator(), &dominatorTree, &loopInfo);
+
+  SmallPtrSet<BasicBlock *, 32> instrumentedBlocks;
+  for (auto &block : F)
+    instrumentedBlocks.insert(&block);
+
+  ValueToValueMapTy valueMap;
+  SmallVector<BasicBlock *, 16> clonedBlocks;
+  cloneLoopWithPreheader(instrumentedPreheader, dispatchBlock, &L, valueMap,
+                         ".concrete", &loopInfo, &dominatorTree, clonedBlocks);
+  remapInstructionsInBlocks(clonedBlocks, valueMap);
+
+  auto *dispatch = BranchInst::Create(
+      cast<BasicBlock>(valueMap[instrumentedPreheader]), instrumentedPreheader,
+      ConstantInt::getTrue(F.getContext()));
+  ReplaceInstWithInst(dispatchBlock->getTerminator(), dispatch);
+  concreteVersions.push_back(
+      {dispatch, {liveIns.begin(), liveIns.end()}, false});
+
+  for (auto *exitBlock : exitBlocks) {
+    for (auto &phi : exitBlock->phis()) {
+      for (unsigned incoming = 0, totalIncoming = phi.getNumIncomingValues();
+           incoming < totalIncoming; incoming++) {
+        auto *value = phi.getIncomingValue(incoming);
+        Value *concreteValue = valueMap.lookup(value);
+        auto *concreteBlock =
+            cast<BasicBlock>(valueMap[phi.getIncomingBlock(incoming)]);
+        phi.addIncoming(concreteValue != nullptr ? concreteValue : value,
+                        concreteBlock);
+      }
+    }
+  }
+
+  // In the concrete version, check the shadow before each memory access and
+  // continue in the instrumented version if the memory may be symbolic.
+  IRBuilder<> IRB(F.getContext());
+  for (auto *access : memoryAccesses) {
+    auto *concreteAccess = cast<Instruction>(valueMap[access]);
+    auto *checkBlock = concreteAccess->getParent();
+    auto *accessBlock = SplitBlock(checkBlock, concreteAccess);
+    IRB.SetInsertPoint(checkBlock->getTerminator());
+
+    Value *addr;
+    Type *dataType;
+    Align alignment;
+    if (auto *load = dyn_cast<LoadInst>(concreteAccess)) {
+      addr = load->getPointerOperand();
+      dataType = load->getType();
+      alignment = load->getAlign();
+    } else {
+      auto *store = cast<StoreInst>(concreteAccess);
+      addr = store->getPointerOperand();
+      dataType = store->getValueOperand()->getType();
+      alignment = store->getAlign();
+    }
+
+    auto *mayBeSymbolic =
+        createShadowCheck(IRB, IRB.CreatePtrToInt(addr, intPtrType),
+                          dataLayout.getTypeStoreSize(dataType), alignment);
+    ReplaceInstWithInst(
+        IRB.GetInsertBlock()->getTerminator(),
+        BranchInst::Create(access->getParent(), accessBlock, mayBeSymbolic));
+  }
+
+  for (auto &block : F) {
+    if (!instrumentedBlocks.count(&block))
+      concreteBlocks.insert(&block);
+  }
+
+  // The jumps from the concrete version into the middle of the instrumented
+  // loop mean that values computed in the latter may now come from either
+  // version.
+  if (memoryAccesses.empty())
+    return;
+
+  SSAUpdater ssaUpdater;
+  for (auto *I : loopInstructions) {
+    SmallVector<Use *, 8> usesToRewrite;
+    for (auto &use : I->uses()) {
+      auto *user = cast<Instruction>(use.getUser());
+      auto *userBlock = isa<PHINode>(user)
+                            ? cast<PHINode>(user)->getIncomingBlock(use)
+                            : user->getParent();
+      if (userBlock != I->getParent())
+        usesToRewrite.push_back(&use);
+    }
+
+    if (usesToRewrite.empty())
+      continue;
+
+    auto *concreteI = cast<Instruction>(valueMap[I]);
+    ssaUpdater.Initialize(I->getType(), I->getName());
+    ssaUpdater.AddAvailableValue(I->getParent(), I);
+    ssaUpdater.AddAvailableValue(concreteI->getParent(), concreteI);
+    for (auto *use : usesToRewrite)
+      ssaUpdater.RewriteUse(*use);
+  }
+}
+
+void Symbolizer::addConcreteDispatch(Function &F, Function &concreteVersion) {
+  // Static allocas have to stay in the entry block; the dispatch follows them.
+  auto &entry = F.getEntryBlock();
+  auto splitPoint = entry.begin();
+  while (isa<AllocaInst>(*splitPoint))
+    ++splitPoint;
+  auto *body = SplitBlock(&entry, &*splitPoint);
+
+  auto *concreteBlock = BasicBlock::Create(F.getContext(), "", &F, body);
+  concreteBlocks.insert(concreteBlock);
+  IRBuilder<> IRB(concreteBlock);
+  SmallVector<Value *, 8> args;
+  for (auto &arg : F.args())
+    args.push_back(&arg);
+  auto *call = IRB.CreateCall(&concreteVersion, args);
+  call->setCallingConv(concreteVersion.getCallingConv());
+  call->setAttributes(concreteVersion.getAttributes());
+  call->setTailCall();
+  if (F.getReturnType()->isVoidTy())
+    IRB.CreateRetVoid();
+  else
+    IRB.CreateRet(call);
+
+  // The caller has set the return expression to null already (or the clone
+  // returns a null expression along with its result), so we don't need to do
+  // that for the concrete version.
+  functionDispatch =
+      BranchInst::Create(concreteBlock, body, ConstantInt::getTrue(F.getContext()));
+  ReplaceInstWithInst(entry.getTerminator(), functionDispatch);
+  concreteVersions.push_back({functionDispatch, args, true});
+}
+
 void Symbolizer::symbolizeFunctionArguments(Function &F) {
   // The main function doesn't receive symbolic arguments.
   if (F.getName() == "main")
     return;
 
+  // Internal functions receive the expressions as additional arguments.
+  if (passesExpressions(&F)) {
+    auto numParams = F.arg_size() / 2;
+    for (unsigned i = 0; i < numParams; i++) {
+      auto *arg = F.getArg(i);
+      if (!arg->user_empty())
+        symbolicExpressions[arg] = F.getArg(numParams + i);
+    }
+    return;
+  }
+
   IRBuilder<> IRB(F.getEntryBlock().getFirstNonPHI());
 
   for (auto &arg : F.args()) {
@@ -40,8 +355,63 @@ void Symbolizer::symbolizeFunctionArguments(Function &F) {
 }
 
 void Symbolizer::insertBasicBlockNotification(llvm::BasicBlock &B) {
+  // The block that dispatches to the concrete version of the function doesn't
+  // need a notification; the instrumented body has its own.
+  if (functionDispatch != nullptr && &B == functionDispatch->getParent())
+    return;
+
+  if (notificationMode != NotificationMode::All && !mayCallBackend(B))
+    return;
+
   IRBuilder<> IRB(&*B.getFirstInsertionPt());
-  IRB.CreateCall(runtime.notifyBasicBlock, getTargetPreferredInt(&B));
+  insertNotification(IRB, Runtime::kBasicBlockNotification, &B);
+}
+
+void Symbolizer::insertGarbageCollectionSafePoints(Function &F) {
+  DominatorTree dominatorTree(F);
+  LoopInfo loopInfo(dominatorTree);
+
+  // If the function has a concrete version, we only need to collect garbage on
+  // the instrumented path.
+  SmallPtrSet<BasicBlock *, 8> safePoints{functionDispatch != nullptr
+                                              ? functionDispatch->getSuccessor(1)
+                                              : &F.getEntryBlock()};
+  for (auto *loop : loopInfo.getLoopsInPreorder())
+    safePoints.insert(loop->getHeader());
+  safePoints.insert(versionedLoopHeaders.begin(), versionedLoopHeaders.end());
+
+  for (auto *block : safePoints) {
+    // Concrete loop versions don't create expressions, so there is nothing to
+    // collect.
+    if (isConcreteBlock(*block))
+      continue;
+
+    auto insertionPoint = block->getFirstInsertionPt();
+    if (insertionPoint == block->end())
+      continue;
+
+    IRBuilder<> IRB(&*insertionPoint);
+    IRB.CreateCall(runtime.collectGarbage);
+  }
+}
+
+void Symbolizer::finalizeConcreteVersions() {
+  for (auto &version : concreteVersions) {
+    IRBuilder<> IRB(version.dispatch);
+    auto *nullExpression = ConstantPointerNull::get(IRB.getInt8PtrTy());
+    Value *allConcrete = IRB.getTrue();
+    if (version.needsConcreteMemory)
+      allConcrete = IRB.CreateICmpEQ(
+          IRB.CreateLoad(intPtrType, runtime.shadowedPages),
+          ConstantInt::get(intPtrType, 0));
+    for (auto *liveIn : version.liveIns) {
+      if (auto *expr = getSymbolicExpression(liveIn))
+        allConcrete =
+            IRB.CreateAnd(allConcrete, IRB.CreateICmpEQ(expr, nullExpression));
+    }
+
+    version.dispatch->setCondition(allConcrete);
+  }
 }
 
 void Symbolizer::finalizePHINodes() {
@@ -80,25 +450,128 @@ void Symbolizer::finalizePHINodes() {
   symbolicExpressions.clear();
 }
 
+void Symbolizer::mergeDependentComputations() {
+  // Never move the boundaries of a computation; the code between them has to
+  // stay contiguous.
+  SmallPtrSet<Instruction *, 32> boundaries;
+  for (const auto &computation : expressionUses) {
+    boundaries.insert(computation.firstInstruction);
+    boundaries.insert(computation.lastInstruction);
+  }
+
+  std::vector<SymbolicComputation> merged;
+  SmallPtrSet<Instruction *, 32> mergedInstructions;
+  auto addInstructions = [&](const SymbolicComputation &computation) {
+    for (auto *I = computation.firstInstruction;; I = I->getNextNode()) {
+      mergedInstructions.insert(I);
+      if (I == computation.lastInstruction)
+        break;
+    }
+  };
+  auto isMerged = [&](Value *V) {
+    auto *I = dyn_cast<Instruction>(V);
+    return (I != nullptr && mergedInstructions.count(I) > 0);
+  };
+
+  auto canMerge = [&](const SymbolicComputation &previous,
+                      const SymbolicComputation &next) {
+    if (next.firstInstruction->getParent() !=
+            previous.lastInstruction->getParent() ||
+        !previous.lastInstruction->comesBefore(next.firstInstruction))
+      return false;
+
+    if (std::none_of(next.inputs.begin(), next.inputs.end(),
+                     [&](const Input &input) {
+                       return isMerged(input.getSymbolicOperand());
+                     }))
+      return false;
+
+    for (auto *I = previous.lastInstruction->getNextNode();
+         I != next.firstInstruction; I = I->getNextNode()) {
+      if (boundaries.count(I) > 0 ||
+          !(isa<DbgInfoIntrinsic>(I) || isSafeToSpeculativelyExecute(I)) ||
+          std::any_of(I->op_begin(), I->op_end(), isMerged))
+        return false;
+    }
+
+    return true;
+  };
+
+  for (const auto &computation : expressionUses) {
+    if (merged.empty() || !canMerge(merged.back(), computation)) {
+      merged.push_back(computation);
+      mergedInstructions.clear();
+      addInstructions(computation);
+      continue;
+    }
+
+    auto &previous = merged.back();
+    while (previous.lastInstruction->getNextNode() !=
+           computation.firstInstruction)
+      previous.lastInstruction->getNextNode()->moveBefore(
+          previous.firstInstruction);
+
+    previous.merge(computation);
+    addInstructions(computation);
+  }
+
+  expressionUses = std::move(merged);
+}
+
 void Symbolizer::shortCircuitExpressionUses() {
+  mergeDependentComputations();
+
   for (auto &symbolicComputation : expressionUses) {
     assert(!symbolicComputation.inputs.empty() &&
            "Symbolic computation has no inputs");
 
     IRBuilder<> IRB(symbolicComputation.firstInstruction);
 
+    // Inputs computed by an earlier part of a merged computation aren't
+    // available up front; moreover, they are null whenever all other inputs
+    // are.
+    SmallPtrSet<Instruction *, 16> computationInstructions;
+    for (auto *I = symbolicComputation.firstInstruction;; I = I->getNextNode()) {
+      computationInstructions.insert(I);
+      if (I == symbolicComputation.lastInstruction)
+        break;
+    }
+    auto isInternal = [&](const Input &input) {
+      auto *I = dyn_cast<Instruction>(input.getSymbolicOperand());
+      return (I != nullptr && computationInstructions.count(I) > 0);
+    };
+
+    // Remember where the results of the computation are used afterwards;
+    // those uses need to see null if we short-circuit.
+    SmallVector<std::pair<Instruction *, SmallVector<Use *, 4>>, 2> results;
+    for (auto *I = symbolicComputation.firstInstruction;; I = I->getNextNode()) {
+      SmallVector<Use *, 4> outsideUses;
+      for (auto &use : I->uses())
+        if (!computationInstructions.count(cast<Instruction>(use.getUser())))
+          outsideUses.push_back(&use);
+      if (!outsideUses.empty())
+        results.emplace_back(I, std::move(outsideUses));
+      if (I == symbolicComputation.lastInstruction)
+        break;
+    }
+
     // Build the check whether any input expression is non-null (i.e., there
     // is a symbolic input).
     auto *nullExpression = ConstantPointerNull::get(IRB.getInt8PtrTy());
-    std::vector<Value *> nullChecks;
-    for (const auto &input : symbolicComputation.inputs) {
-      nullChecks.push_back(
-          IRB.CreateICmpEQ(nullExpression, input.getSymbolicOperand()));
-    }
-    auto *allConcrete = nullChecks[0];
-    for (unsigned argIndex = 1; argIndex < nullChecks.size(); argIndex++) {
-      allConcrete = IRB.CreateAnd(allConcrete, nullChecks[argIndex]);
+    std::vector<Value *> nullChecks(symbolicComputation.inputs.size());
+    Value *allConcrete = nullptr;
+    for (unsigned argIndex = 0; argIndex < nullChecks.size(); argIndex++) {
+      const auto &input = symbolicComputation.inputs[argIndex];
+      if (isInternal(input))
+        continue;
+
+      nullChecks[argIndex] =
+          IRB.CreateICmpEQ(nullExpression, input.getSymbolicOperand());
+      allConcrete = (allConcrete == nullptr)
+                        ? nullChecks[argIndex]
+                        : IRB.CreateAnd(allConcrete, nullChecks[argIndex]);
     }
+    assert(allConcrete != nullptr && "Symbolic computation has no inputs");
 
     // The main branch: if we don't enter here, we can short-circuit the
     // symbolic computation. Otherwise, we need to check all input expressions
@@ -113,16 +586,28 @@ void Symbolizer::shortCircuitExpressionUses() {
     // In the slow case, we need to check each input expression for null
     // (i.e., the input is concrete) and create an expression from the
     // concrete value if necessary.
-    auto numUnknownConcreteness = std::count_if(
-        symbolicComputation.inputs.begin(), symbolicComputation.inputs.end(),
-        [&](const Input &input) {
-          return (input.getSymbolicOperand() != nullExpression);
-        });
+    SmallPtrSet<Value *, 8> unknownConcreteness;
+    for (const auto &input : symbolicComputation.inputs)
+      if (input.getSymbolicOperand() != nullExpression && !isInternal(input))
+        unknownConcreteness.insert(input.getSymbolicOperand());
+    auto numUnknownConcreteness = unknownConcreteness.size();
+    // Parts of a merged computation often share inputs; we prepare each of
+    // them only once.
+    DenseMap<Value *, Value *> preparedInputs;
     for (unsigned argIndex = 0; argIndex < symbolicComputation.inputs.size();
          argIndex++) {
       auto &argument = symbolicComputation.inputs[argIndex];
       auto *originalArgExpression = argument.getSymbolicOperand();
-      auto *argCheckBlock = symbolicComputation.firstInstruction->getParent();
+      bool internal = isInternal(argument);
+      if (!internal) {
+        if (auto *prepared = preparedInputs.lookup(argument.concreteValue)) {
+          argument.replaceOperand(prepared);
+          continue;
+        }
+      }
+      auto *insertionPoint =
+          internal ? argument.user : symbolicComputation.firstInstruction;
+      auto *argCheckBlock = insertionPoint->getParent();
 
       // We only need a run-time check for concreteness if the argument isn't
       // known to be concrete at compile time already. However, there is one
@@ -131,51 +616,89 @@ void Symbolizer::shortCircuitExpressionUses() {
       // in the slow path. Therefore, we can skip expression generation in
       // that case.
       bool needRuntimeCheck = originalArgExpression != nullExpression;
-      if (needRuntimeCheck && (numUnknownConcreteness == 1))
+      if (needRuntimeCheck && !internal && (numUnknownConcreteness == 1))
         continue;
 
       if (needRuntimeCheck) {
+        if (internal) {
+          IRB.SetInsertPoint(insertionPoint);
+          nullChecks[argIndex] =
+              IRB.CreateICmpEQ(nullExpression, originalArgExpression);
+        }
         auto *argExpressionBlock = SplitBlockAndInsertIfThen(
-            nullChecks[argIndex], symbolicComputation.firstInstruction,
-            /* unreachable */ false);
+            nullChecks[argIndex], insertionPoint, /* unreachable */ false);
         IRB.SetInsertPoint(argExpressionBlock);
       } else {
-        IRB.SetInsertPoint(symbolicComputation.firstInstruction);
+        IRB.SetInsertPoint(insertionPoint);
       }
 
       auto *newArgExpression =
           createValueExpression(argument.concreteValue, IRB);
+      auto *newArgExpressionBlock = IRB.GetInsertBlock();
 
       Value *finalArgExpression;
       if (needRuntimeCheck) {
-        IRB.SetInsertPoint(symbolicComputation.firstInstruction);
+        IRB.SetInsertPoint(insertionPoint);
         auto *argPHI = IRB.CreatePHI(IRB.getInt8PtrTy(), 2);
         argPHI->addIncoming(originalArgExpression, argCheckBlock);
-        argPHI->addIncoming(newArgExpression, newArgExpression->getParent());
+        argPHI->addIncoming(newArgExpression, newArgExpressionBlock);
         finalArgExpression = argPHI;
       } else {
         finalArgExpression = newArgExpression;
       }
 
       argument.replaceOperand(finalArgExpression);
+      if (!internal)
+        preparedInputs[argument.concreteValue] = finalArgExpression;
     }
 
-    // Finally, the overall result (if the computation produces one) is null
-    // if we've taken the fast path and the symbolic expression computed above
-    // if short-circuiting wasn't possible.
-    if (!symbolicComputation.lastInstruction->use_empty()) {
-      IRB.SetInsertPoint(&tail->front());
-      auto *finalExpression = IRB.CreatePHI(IRB.getInt8PtrTy(), 2);
-      symbolicComputation.lastInstruction->replaceAllUsesWith(finalExpression);
-      finalExpression->addIncoming(ConstantPointerNull::get(IRB.getInt8PtrTy()),
+    // Finally, the results of the computation are null if we've taken the
+    // fast path and the symbolic expressions computed above if
+    // short-circuiting wasn't possible.
+    IRB.SetInsertPoint(&tail->front());
+    for (auto &[result, uses] : results) {
+      auto *finalExpression = IRB.CreatePHI(result->getType(), 2);
+      finalExpression->addIncoming(Constant::getNullValue(result->getType()),
                                    head);
       finalExpression->addIncoming(
-          symbolicComputation.lastInstruction,
-          symbolicComputation.lastInstruction->getParent());
+          result, symbolicComputation.lastInstruction->getParent());
+      for (auto *use : uses)
+        use->set(finalExpression);
     }
   }
 }
 
+void Symbolizer::finalizeNotifications() {
+  if (notificationMode != NotificationMode::Buffered)
+    return;
+
+  auto *bufferType =
+      ArrayType::get(intPtrType, Runtime::kNotificationBufferSize);
+  for (auto [call, kind] : notifications) {
+    // Site IDs are addresses of LLVM objects, so the two least significant
+    // bits are free to hold the kind of notification.
+    auto *site = cast<ConstantInt>(call->getArgOperand(0));
+    assert((site->getZExtValue() & 3) == 0 && "Site ID is not aligned");
+
+    IRBuilder<> IRB(call);
+    auto *count = IRB.CreateLoad(intPtrType, runtime.notificationCount);
+    IRB.CreateStore(ConstantInt::get(intPtrType, site->getZExtValue() | kind),
+                    IRB.CreateInBoundsGEP(bufferType, runtime.notificationBuffer,
+                                          {IRB.getInt64(0), count}));
+    auto *newCount = IRB.CreateAdd(count, ConstantInt::get(intPtrType, 1));
+    IRB.CreateStore(newCount, runtime.notificationCount);
+
+    // When the buffer is full, the run-time library has to drain it before we
+    // can append the next entry.
+    auto *full = IRB.CreateICmpEQ(
+        newCount, ConstantInt::get(intPtrType, Runtime::kNotificationBufferSize));
+    IRB.SetInsertPoint(SplitBlockAndInsertIfThen(full, call, false));
+    IRB.CreateCall(runtime.flushNotifications);
+
+    call->eraseFromParent();
+  }
+}
+
 void Symbolizer::handleIntrinsicCall(CallBase &I) {
   auto *callee = I.getCalledFunction();
 
@@ -309,13 +832,24 @@ void Symbolizer::handleFunctionCall(CallBase &I, Instruction *returnPoint) {
   }
 
   IRBuilder<> IRB(returnPoint);
-  IRB.CreateCall(runtime.notifyRet, getTargetPreferredInt(&I));
+  insertNotification(IRB, Runtime::kReturnNotification, &I);
   IRB.SetInsertPoint(&I);
-  IRB.CreateCall(runtime.notifyCall, getTargetPreferredInt(&I));
+  insertNotification(IRB, Runtime::kCallNotification, &I);
 
   if (callee == nullptr)
     tryAlternative(IRB, I.getCalledOperand());
 
+  // Internal callees take the argument expressions as additional parameters,
+  // and they return the result's expression along with the value (see
+  // visitExtractValueInst).
+  if (passesExpressions(callee)) {
+    auto numParams = callee->arg_size() / 2;
+    for (unsigned i = 0; i < numParams; i++)
+      I.setArgOperand(numParams + i,
+                      getSymbolicExpressionOrNull(I.getArgOperand(i)));
+    return;
+  }
+
   for (Use &arg : I.args())
     IRB.CreateCall(runtime.setParameterExpression,
                    {ConstantInt::get(IRB.getInt8Ty(), arg.getOperandNo()),
@@ -400,6 +934,20 @@ void Symbolizer::visitReturnInst(ReturnInst &I) {
   if (I.getReturnValue() == nullptr)
     return;
 
+  // Functions that return pairs of value and expression fill in the
+  // expression here.
+  if (passesExpressions(I.getFunction())) {
+    auto *pair = cast<InsertValueInst>(I.getReturnValue());
+    auto *value = cast<InsertValueInst>(pair->getAggregateOperand());
+    assert(isReturnPair(*pair) && isReturnPair(*value) &&
+           "Functions that pass expressions must return marked pairs");
+    pair->setOperand(
+        1, getSymbolicExpressionOrNull(value->getInsertedValueOperand()));
+    pair->setMetadata(kReturnPairMD, nullptr);
+    value->setMetadata(kReturnPairMD, nullptr);
+    return;
+  }
+
   // We can't short-circuit this call because the return expression needs to
   // be set even if it's null; otherwise we break the caller. Therefore,
   // create the call directly without registering it for short-circuit
@@ -460,11 +1008,19 @@ void Symbolizer::visitLoadInst(LoadInst &I) {
   auto *addr = I.getPointerOperand();
   tryAlternative(IRB, addr);
 
+  // Most memory is concrete, so we only call the run-time library if the
+  // shadow page table says that the memory may be symbolic.
   auto *dataType = I.getType();
-  auto *data = IRB.CreateCall(
+  auto size = dataLayout.getTypeStoreSize(dataType);
+  auto *addrInt = IRB.CreatePtrToInt(addr, intPtrType);
+  auto *mayBeSymbolic = createShadowCheck(IRB, addrInt, size, I.getAlign());
+  auto *head = IRB.GetInsertBlock();
+  IRB.SetInsertPoint(
+      SplitBlockAndInsertIfThen(mayBeSymbolic, &I, /* unreachable */ false));
+
+  Value *data = IRB.CreateCall(
       runtime.readMemory,
-      {IRB.CreatePtrToInt(addr, intPtrType),
-       ConstantInt::get(intPtrType, dataLayout.getTypeStoreSize(dataType)),
+      {addrInt, ConstantInt::get(intPtrType, size),
        ConstantInt::get(IRB.getInt8Ty(), isLittleEndian(dataType) ? 1 : 0)});
 
   if (dataType->isFloatingPointTy()) {
@@ -472,7 +1028,13 @@ void Symbolizer::visitLoadInst(LoadInst &I) {
                           {data, IRB.getInt1(dataType->isDoubleTy())});
   }
 
-  symbolicExpressions[&I] = data;
+  auto *slowPath = IRB.GetInsertBlock();
+  IRB.SetInsertPoint(&I);
+  auto *dataPHI = IRB.CreatePHI(IRB.getInt8PtrTy(), 2);
+  dataPHI->addIncoming(ConstantPointerNull::get(IRB.getInt8PtrTy()), head);
+  dataPHI->addIncoming(data, slowPath);
+
+  symbolicExpressions[&I] = dataPHI;
 }
 
 void Symbolizer::visitStoreInst(StoreInst &I) {
@@ -480,17 +1042,28 @@ void Symbolizer::visitStoreInst(StoreInst &I) {
 
   tryAlternative(IRB, I.getPointerOperand());
 
+  // We can skip the run-time library if we store a concrete value to concrete
+  // memory.
   auto *data = getSymbolicExpressionOrNull(I.getValueOperand());
   auto *dataType = I.getValueOperand()->getType();
+  auto size = dataLayout.getTypeStoreSize(dataType);
+  auto *addrInt = IRB.CreatePtrToInt(I.getPointerOperand(), intPtrType);
+  auto *needCall = createShadowCheck(IRB, addrInt, size, I.getAlign());
+  if (!isa<ConstantPointerNull>(data)) {
+    needCall = IRB.CreateOr(
+        IRB.CreateICmpNE(data, ConstantPointerNull::get(IRB.getInt8PtrTy())),
+        needCall);
+  }
+  IRB.SetInsertPoint(
+      SplitBlockAndInsertIfThen(needCall, &I, /* unreachable */ false));
+
   if (dataType->isFloatingPointTy()) {
     data = IRB.CreateCall(runtime.buildFloatToBits, data);
   }
 
   IRB.CreateCall(
       runtime.writeMemory,
-      {IRB.CreatePtrToInt(I.getPointerOperand(), intPtrType),
-       ConstantInt::get(intPtrType, dataLayout.getTypeStoreSize(dataType)),
-       data,
+      {addrInt, ConstantInt::get(intPtrType, size), data,
        ConstantInt::get(IRB.getInt8Ty(), dataLayout.isLittleEndian() ? 1 : 0)});
 }
 
@@ -750,6 +1323,9 @@ void Symbolizer::visitPHINode(PHINode &I) {
 }
 
 void Symbolizer::visitInsertValueInst(InsertValueInst &I) {
+  if (isReturnPair(I))
+    return;
+
   IRBuilder<> IRB(&I);
   auto insert = buildRuntimeCall(
       IRB, runtime.buildInsert,
@@ -764,6 +1340,23 @@ void Symbolizer::visitInsertValueInst(InsertValueInst &I) {
 
 void Symbolizer::visitExtractValueInst(ExtractValueInst &I) {
   IRBuilder<> IRB(&I);
+
+  // The result of a call to an internal function comes with its expression.
+  if (I.getMetadata(kCallResultMD) != nullptr) {
+    auto *call = cast<CallBase>(I.getAggregateOperand());
+    assert(passesExpressions(call->getCalledFunction()) &&
+           "Only calls to functions that pass expressions have marked results");
+    symbolicExpressions[&I] = IRB.CreateExtractValue(call, 1);
+    I.setMetadata(kCallResultMD, nullptr);
+    return;
+  }
+
+  assert(!(isa<CallBase>(I.getAggregateOperand()) &&
+           passesExpressions(
+               cast<CallBase>(I.getAggregateOperand())->getCalledFunction())) &&
+         "Results of functions that pass expressions must be extracted by the "
+         "marked instructions");
+
   auto extract = buildRuntimeCall(
       IRB, runtime.buildExtract,
       {{I.getAggregateOperand(), true},
@@ -818,7 +1411,140 @@ void Symbolizer::visitInstruction(Instruction &I) {
          << "; the result will be concretized\n";
 }
 
-CallInst *Symbolizer::createValueExpression(Value *V, IRBuilder<> &IRB) {
+Value *Symbolizer::createValueExpression(Value *V, IRBuilder<> &IRB) {
+  // We can only reuse the expression of a constant if its value is the same
+  // wherever it's used. This isn't the case for undef (which we don't cache)
+  // or for the addresses of thread-local variables.
+  auto *C = dyn_cast<Constant>(V);
+  bool cacheable =
+      (C != nullptr) && (isa<ConstantInt>(C) || isa<ConstantFP>(C) ||
+                         isa<ConstantPointerNull>(C) ||
+                         (isa<GlobalValue>(C) &&
+                          !cast<GlobalValue>(C)->isThreadLocal()));
+  if (!cacheable)
+    return buildValueExpression(V, IRB);
+
+  // Load the cached expression and build it only if the cache is empty.
+  auto *cache =
+      getConstantExpressionCache(C, *IRB.GetInsertBlock()->getModule());
+  auto *cachedExpr = IRB.CreateLoad(IRB.getInt8PtrTy(), cache);
+  auto *cacheMiss = IRB.CreateICmpEQ(cachedExpr, getEmptyExpressionCache());
+  auto *cacheMissTerm = SplitBlockAndInsertIfThen(
+      cacheMiss, &*IRB.GetInsertPoint(), /* unreachable */ false);
+
+  IRB.SetInsertPoint(cacheMissTerm);
+  auto *newExpr = buildValueExpression(V, IRB);
+  IRB.CreateStore(newExpr, cache);
+
+  IRB.SetInsertPoint(&cacheMissTerm->getSuccessor(0)->front());
+  auto *expr = IRB.CreatePHI(IRB.getInt8PtrTy(), 2);
+  expr->addIncoming(cachedExpr, cachedExpr->getParent());
+  expr->addIncoming(newExpr, cacheMissTerm->getParent());
+  return expr;
+}
+
+Value *Symbolizer::createShadowCheck(IRBuilder<> &IRB, Value *addr,
+                                     uint64_t size, Align alignment) {
+  // Accesses that may cross a page boundary need two lookups; we leave them to
+  // the run-time library.
+  auto pageSize = uint64_t(1) << Runtime::kShadowPageBits;
+  if (size == 0 || size > pageSize)
+    return IRB.getTrue();
+
+  auto *insertionPoint = &*IRB.GetInsertPoint();
+  auto *entryBlock = IRB.GetInsertBlock();
+  auto *mergeBlock = SplitBlock(entryBlock, insertionPoint);
+  entryBlock->getTerminator()->eraseFromParent();
+
+  IRB.SetInsertPoint(mergeBlock, mergeBlock->begin());
+  auto *result =
+      IRB.CreatePHI(IRB.getInt1Ty(), runtime.shadowPageTableLevels + 1);
+
+  IRB.SetInsertPoint(entryBlock);
+  if (alignment.value() < size) {
+    auto *walkBlock = BasicBlock::Create(IRB.getContext(), "",
+                                         entryBlock->getParent(), mergeBlock);
+    auto *crossesPage =
+        IRB.CreateICmpUGT(IRB.CreateAnd(addr, pageSize - 1),
+                          ConstantInt::get(intPtrType, pageSize - size));
+    IRB.CreateCondBr(crossesPage, mergeBlock, walkBlock);
+    result->addIncoming(IRB.getTrue(), IRB.GetInsertBlock());
+    IRB.SetInsertPoint(walkBlock);
+  }
+
+  // Walk the page table just like lookupShadowPage in the run-time library.
+  // Most of the time, memory is concrete because the intermediate tables
+  // don't even exist, so we exit as soon as we find a null entry.
+  auto *ptrT = IRB.getInt8PtrTy();
+  Value *table =
+      IRB.CreateBitCast(runtime.shadowPageTable, ptrT->getPointerTo());
+  for (unsigned level = 0; level < runtime.shadowPageTableLevels; level++) {
+    auto shift = Runtime::kShadowPageBits +
+                 (runtime.shadowPageTableLevels - 1 - level) *
+                     runtime.shadowPageTableBits;
+    auto *index =
+        IRB.CreateAnd(IRB.CreateLShr(addr, shift),
+                      (uint64_t(1) << runtime.shadowPageTableBits) - 1);
+    auto *entry = IRB.CreateLoad(ptrT, IRB.CreateGEP(ptrT, table, index));
+
+    if (level == runtime.shadowPageTableLevels - 1) {
+      result->addIncoming(
+          IRB.CreateICmpNE(entry, ConstantPointerNull::get(ptrT)),
+          IRB.GetInsertBlock());
+      IRB.CreateBr(mergeBlock);
+      break;
+    }
+
+    auto *isNull = IRB.CreateICmpEQ(entry, ConstantPointerNull::get(ptrT));
+    auto *nextBlock = BasicBlock::Create(IRB.getContext(), "",
+                                         entryBlock->getParent(), mergeBlock);
+    IRB.CreateCondBr(isNull, mergeBlock, nextBlock);
+    result->addIncoming(IRB.getFalse(), IRB.GetInsertBlock());
+    IRB.SetInsertPoint(nextBlock);
+    table = IRB.CreateBitCast(entry, ptrT->getPointerTo());
+  }
+
+  IRB.SetInsertPoint(insertionPoint);
+  return result;
+}
+
+Constant *Symbolizer::getConstantExpressionCache(Constant *C, Module &M) {
+  auto &slot = constantExpressions.slots[C];
+  if (slot != nullptr)
+    return slot;
+
+  constexpr auto slotsPerArray = ConstantExpressionCache::kSlotsPerArray;
+  auto *ptrT = Type::getInt8PtrTy(M.getContext());
+  auto *arrayT = ArrayType::get(ptrT, slotsPerArray);
+  if (constantExpressions.array == nullptr ||
+      constantExpressions.usedSlots == slotsPerArray) {
+    SmallVector<Constant *, slotsPerArray> empty(slotsPerArray,
+                                                 getEmptyExpressionCache());
+    constantExpressions.array = new GlobalVariable(
+        M, arrayT, false, GlobalValue::PrivateLinkage,
+        ConstantArray::get(arrayT, empty), "__sym_constant_expressions");
+    constantExpressions.usedSlots = 0;
+
+    // Register the array once and for all, before any instrumented code can
+    // fill it.
+    IRBuilder<> IRB(
+        constantExpressions.constructor->getEntryBlock().getTerminator());
+    IRB.CreateCall(
+        runtime.registerExpressionRegion,
+        {IRB.CreateBitCast(constantExpressions.array, ptrT->getPointerTo()),
+         ConstantInt::get(intPtrType, slotsPerArray)});
+  }
+
+  auto *int32T = Type::getInt32Ty(M.getContext());
+  Constant *indices[] = {
+      ConstantInt::get(int32T, 0),
+      ConstantInt::get(int32T, constantExpressions.usedSlots++)};
+  slot = ConstantExpr::getInBoundsGetElementPtr(
+      arrayT, constantExpressions.array, indices);
+  return slot;
+}
+
+CallInst *Symbolizer::buildValueExpression(Value *V, IRBuilder<> &IRB) {
   auto *valueType = V->getType();
 
   if (isa<ConstantPointerNull>(V)) {
@@ -908,7 +1634,7 @@ Symbolizer::forceBuildRuntimeCall(IRBuilder<> &IRB, SymFnT function,
 void Symbolizer::tryAlternative(IRBuilder<> &IRB, Value *V) {
   auto *destExpr = getSymbolicExpression(V);
   if (destExpr != nullptr) {
-    auto *concreteDestExpr = createValueExpression(V, IRB);
+    auto *concreteDestExpr = buildValueExpression(V, IRB);
     auto *destAssertion =
         IRB.CreateCall(runtime.comparisonHandlers[CmpInst::ICMP_EQ],
                        {destExpr, concreteDestExpr});
@@ -920,6 +1646,31 @@ void Symbolizer::tryAlternative(IRBuilder<> &IRB, Value *V) {
   }
 }
 
+void Symbolizer::insertNotification(IRBuilder<> &IRB,
+                                    Runtime::NotificationKind kind,
+                                    void *site) {
+  if (notificationMode == NotificationMode::None)
+    return;
+
+  SymFnT notification;
+  switch (kind) {
+  case Runtime::kBasicBlockNotification:
+    notification = runtime.notifyBasicBlock;
+    break;
+  case Runtime::kCallNotification:
+    notification = runtime.notifyCall;
+    break;
+  case Runtime::kReturnNotification:
+    notification = runtime.notifyRet;
+    break;
+  default:
+    llvm_unreachable("Unknown notification kind");
+  }
+
+  notifications.emplace_back(
+      IRB.CreateCall(notification, getTargetPreferredInt(site)), kind);
+}
+
 uint64_t Symbolizer::aggregateMemberOffset(Type *aggregateType,
                                            ArrayRef<unsigned> indices) const {
   uint64_t offset = 0;
@@ -15,6 +15,9 @@
 #ifndef SYMBOLIZE_H
 #define SYMBOLIZE_H
 
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/LoopInfo.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/InstVisitor.h>
@@ -24,20 +27,141 @@
 
 #include "Runtime.h"
 
+/// The attribute of functions that take the symbolic expressions of their
+/// arguments as additional parameters and return a pair of value and
+/// expression, rather than exchanging expressions via the run-time library
+/// (see PrepareSymbolizationPass::passExpressionsInArguments).
+constexpr char kExpressionPassingAttr[] = "symcc-expression-passing";
+
+/// The metadata of the instructions that pack the result of such a function
+/// together with its (initially null) expression before returning.
+constexpr char kReturnPairMD[] = "symcc.return_pair";
+
+/// The metadata of the instructions that unpack the result of a call to such
+/// a function.
+constexpr char kCallResultMD[] = "symcc.call_result";
+
+/// The slots that cache the symbolic expressions of compile-time constants in
+/// a module; see Symbolizer::constantExpressions.
+struct ConstantExpressionCache {
+  /// The number of slots that we allocate at a time.
+  static constexpr unsigned kSlotsPerArray = 64;
+
+  /// Mapping from constants to the addresses of their slots.
+  llvm::DenseMap<llvm::Constant *, llvm::Constant *> slots;
+
+  /// The array that new slots come from, and the number of its slots in use.
+  llvm::GlobalVariable *array = nullptr;
+  unsigned usedSlots = 0;
+
+  /// The module's constructor, which registers the arrays with the garbage
+  /// collector.
+  llvm::Function *constructor = nullptr;
+
+  void reset(llvm::Function *moduleConstructor) {
+    slots.clear();
+    array = nullptr;
+    usedSlots = 0;
+    constructor = moduleConstructor;
+  }
+};
+
+/// Determine whether the call is to an intrinsic that uninstrumented code can
+/// use as is, i.e., one that the instrumentation either ignores or merely
+/// builds expressions for.
+bool isConcreteIntrinsicCall(const llvm::CallBase &call);
+
+/// How instrumented code tells the run-time library about basic blocks, calls
+/// and returns. Only QSYM's basic-block pruning uses the information.
+enum class NotificationMode {
+  /// Call the run-time library at every call, return and basic block.
+  All,
+
+  /// Like All, but leave out the basic blocks that can't affect pruning.
+  Needed,
+
+  /// Like Needed, but append the notifications to a buffer in the run-time
+  /// library instead of calling it; the backend catches up when it needs the
+  /// information.
+  Buffered,
+
+  /// Don't notify the run-time library at all.
+  None
+};
+
 class Symbolizer : public llvm::InstVisitor<Symbolizer> {
 public:
-  explicit Symbolizer(llvm::Module &M)
+  Symbolizer(llvm::Module &M, ConstantExpressionCache &constantExpressions,
+             NotificationMode notificationMode)
       : runtime(M), dataLayout(M.getDataLayout()),
         ptrBits(M.getDataLayout().getPointerSizeInBits()),
-        intPtrType(M.getDataLayout().getIntPtrType(M.getContext())) {}
+        intPtrType(M.getDataLayout().getIntPtrType(M.getContext())),
+        constantExpressions(constantExpressions),
+        notificationMode(notificationMode) {}
+
+  /// Create a concrete version of each loop that doesn't need to call the
+  /// run-time library.
+  ///
+  /// Loops often process concrete data only, but the instrumented code still
+  /// checks on every iteration whether the inputs of each computation are
+  /// symbolic. For loops without function calls, we therefore add an
+  /// uninstrumented copy that runs if the symbolic expressions of all values
+  /// flowing into the loop are null; the decision is made in
+  /// finalizeConcreteVersions. Memory may become symbolic while the loop runs, so
+  /// the copy checks the shadow before each memory access and hands over to
+  /// the instrumented loop right at the access if it finds symbolic data.
+  /// This is always possible because all values in the concrete copy have
+  /// null expressions.
+  ///
+  /// This has to be the first transformation because it clones the original
+  /// code; the blocks of the copies are excluded from instrumentation (see
+  /// isConcreteBlock).
+  void versionLoops(llvm::Function &F);
+
+  /// Make the function run the given uninstrumented version of itself if all
+  /// parameter expressions are null and no memory is symbolic.
+  ///
+  /// We don't know which memory the function accesses, so the check covers
+  /// all memory of the process: once the program has read symbolic input,
+  /// calls only go to the concrete version again if all shadow is released.
+  ///
+  /// The concrete version must only call other concrete versions (or
+  /// intrinsics that don't need instrumentation), so that memory can't become
+  /// symbolic while it runs. Like versionLoops, this has to happen before any
+  /// instrumentation; the decision is made in finalizeConcreteVersions.
+  void addConcreteDispatch(llvm::Function &F, llvm::Function &concreteVersion);
+
+  /// Determine whether the basic block belongs to concrete code (see
+  /// versionLoops and addConcreteDispatch) and must therefore not be
+  /// instrumented.
+  bool isConcreteBlock(const llvm::BasicBlock &B) const {
+    return concreteBlocks.count(&B) != 0;
+  }
 
   /// Insert code to obtain the symbolic expressions for the function arguments.
   void symbolizeFunctionArguments(llvm::Function &F);
 
   /// Insert a call to the run-time library to notify it of the basic block
-  /// entry.
+  /// entry (unless the notification mode says otherwise).
   void insertBasicBlockNotification(llvm::BasicBlock &B);
 
+  /// Insert calls to the garbage collector at the function entry and at the
+  /// header of every loop.
+  ///
+  /// These are the points where long-running code is guaranteed to pass
+  /// through regularly. The run-time library decides whether to actually
+  /// collect garbage, so the calls are cheap unless memory is running out.
+  /// This has to happen before the function is instrumented because it relies
+  /// on the original control flow.
+  void insertGarbageCollectionSafePoints(llvm::Function &F);
+
+  /// Emit the checks that choose between concrete and instrumented code.
+  ///
+  /// The function has to be called after all instructions have been processed
+  /// (so that we know the symbolic expressions of the values that enter the
+  /// concrete code) but before finalizePHINodes.
+  void finalizeConcreteVersions();
+
   /// Finish the processing of PHI nodes.
   ///
   /// This assumes that there is a dummy PHI node for each such instruction in
@@ -50,6 +174,13 @@ public:
   /// Important! Calling this function invalidates symbolicExpressions.
   void finalizePHINodes();
 
+  /// Turn the notification calls into code that appends to the run-time
+  /// library's notification buffer if the mode is Buffered.
+  ///
+  /// This splits basic blocks, so it has to run after all other
+  /// instrumentation.
+  void finalizeNotifications();
+
   /// Rewrite symbolic computation to only occur if some operand is symbolic.
   ///
   /// We don't want to build up formulas for symbolic computation if all
@@ -93,6 +224,11 @@ public:
   ///
   /// The resulting code is much longer but avoids solver calls for all
   /// operations without symbolic data.
+  ///
+  /// Computations in a basic block that consume each other's results share a
+  /// single check (see mergeDependentComputations); in the slow path, inputs
+  /// that come from within the merged computation are checked individually
+  /// right before their use.
   void shortCircuitExpressionUses();
 
   void handleIntrinsicCall(llvm::CallBase &I);
@@ -192,8 +328,70 @@ private:
     }
   };
 
+  /// A piece of code with a concrete version (see versionLoops and
+  /// addConcreteDispatch).
+  struct ConcreteVersion {
+    /// The branch that chooses between the concrete and the instrumented
+    /// version; its condition is set by finalizeConcreteVersions.
+    llvm::BranchInst *dispatch;
+
+    /// The values that flow into the code.
+    llvm::SmallVector<llvm::Value *, 8> liveIns;
+
+    /// Whether the concrete version additionally requires all memory to be
+    /// concrete.
+    bool needsConcreteMemory;
+  };
+
+  /// Merge each symbolic computation with the following ones in the same
+  /// basic block that use its result, so that they are short-circuited
+  /// together.
+  ///
+  /// The original instructions between two merged computations have to run
+  /// on the fast path as well, so we only merge if we can move them up front,
+  /// i.e., if they are safe to execute early and don't depend on the
+  /// computation.
+  void mergeDependentComputations();
+
+  /// Add a concrete version of the loop.
+  void versionLoop(llvm::Loop &L, llvm::DominatorTree &dominatorTree,
+                   llvm::LoopInfo &loopInfo);
+
   /// Create an expression that represents the concrete value.
-  llvm::CallInst *createValueExpression(llvm::Value *V, llvm::IRBuilder<> &IRB);
+  ///
+  /// For compile-time constants, the expression is built only once and then
+  /// cached in a global array; see constantExpressions. Note that this
+  /// inserts control flow, so the builder may end up in a different basic
+  /// block.
+  llvm::Value *createValueExpression(llvm::Value *V, llvm::IRBuilder<> &IRB);
+
+  /// Like createValueExpression, but always generate a call to the run-time
+  /// library.
+  llvm::CallInst *buildValueExpression(llvm::Value *V, llvm::IRBuilder<> &IRB);
+
+  /// Emit a check whether the memory at the given address (an integer) may
+  /// contain symbolic data.
+  ///
+  /// The check walks the run-time library's shadow page table, so it's much
+  /// cheaper than a call. It only yields false if the memory is certainly
+  /// concrete, i.e., if there is no shadow for it. Like createValueExpression,
+  /// this inserts control flow.
+  llvm::Value *createShadowCheck(llvm::IRBuilder<> &IRB, llvm::Value *addr,
+                                 uint64_t size, llvm::Align alignment);
+
+  /// Return the address of the slot that caches the expression for the
+  /// constant, allocating it if necessary.
+  llvm::Constant *getConstantExpressionCache(llvm::Constant *C,
+                                             llvm::Module &M);
+
+  /// The content of a slot in constantExpressions before the first use. Null
+  /// would be ambiguous because backends may build null expressions (e.g.,
+  /// QSYM for floating-point constants).
+  llvm::Constant *getEmptyExpressionCache() {
+    return llvm::ConstantExpr::getIntToPtr(
+        llvm::Constant::getAllOnesValue(intPtrType),
+        llvm::Type::getInt8PtrTy(intPtrType->getContext()));
+  }
 
   /// Get the (already created) symbolic expression for a value.
   llvm::Value *getSymbolicExpression(llvm::Value *V) {
@@ -209,6 +407,18 @@ private:
     return expr;
   }
 
+  /// Determine whether the function exchanges symbolic expressions with its
+  /// callers directly (see kExpressionPassingAttr).
+  static bool passesExpressions(const llvm::Function *F) {
+    return F != nullptr && F->hasFnAttribute(kExpressionPassingAttr);
+  }
+
+  /// Determine whether the instruction merely packs a function's result for
+  /// return in a pair with its expression (see kReturnPairMD).
+  static bool isReturnPair(const llvm::Instruction &I) {
+    return I.getMetadata(kReturnPairMD) != nullptr;
+  }
+
   bool isLittleEndian(llvm::Type *type) {
     return (!type->isAggregateType() && dataLayout.isLittleEndian());
   }
@@ -273,6 +483,11 @@ private:
   /// Generate code that makes the solver try an alternative value for V.
   void tryAlternative(llvm::IRBuilder<> &IRB, llvm::Value *V);
 
+  /// Notify the run-time library of a call, return or basic block at the
+  /// given site, unless the notification mode is None.
+  void insertNotification(llvm::IRBuilder<> &IRB,
+                          Runtime::NotificationKind kind, void *site);
+
   /// Helper to use a pointer to a host object as integer (truncating!).
   ///
   /// Note that the conversion will truncate the most significant bits of the
@@ -309,6 +524,23 @@ private:
   /// An integer type at least as wide as a pointer.
   llvm::IntegerType *intPtrType;
 
+  /// The globals caching the symbolic expressions of compile-time constants.
+  ///
+  /// Constants are used over and over again (think of loop bounds or switch
+  /// cases), and there is no point in asking the run-time library for a new
+  /// expression every time. We give each constant a slot in a global array,
+  /// which holds getEmptyExpressionCache() until the program needs the
+  /// expression for the first time. The module's constructor registers each
+  /// array with the garbage collector, so that the expressions stay alive.
+  ConstantExpressionCache &constantExpressions;
+
+  const NotificationMode notificationMode;
+
+  /// The calls that notify the run-time library of calls, returns and basic
+  /// blocks, along with the kind of notification (see finalizeNotifications).
+  llvm::SmallVector<std::pair<llvm::CallInst *, Runtime::NotificationKind>, 32>
+      notifications;
+
   /// Mapping from SSA values to symbolic expressions.
   ///
   /// For pointer values, the stored value is an expression describing the value
@@ -339,6 +571,22 @@ private:
   /// Therefore, we keep a record of all the places that construct expressions
   /// and insert the fast path later.
   std::vector<SymbolicComputation> expressionUses;
+
+  /// The code that we created concrete versions for.
+  std::vector<ConcreteVersion> concreteVersions;
+
+  /// The branch at the function entry that may call the concrete version of
+  /// the function (see addConcreteDispatch), or null.
+  llvm::BranchInst *functionDispatch = nullptr;
+
+  /// The basic blocks of the concrete versions.
+  llvm::SmallPtrSet<const llvm::BasicBlock *, 32> concreteBlocks;
+
+  /// The headers of the instrumented loops that have a concrete version.
+  ///
+  /// The concrete version may enter such loops in the middle, so they aren't
+  /// natural loops anymore, and LoopInfo doesn't find them.
+  llvm::SmallVector<llvm::BasicBlock *, 8> versionedLoopHeaders;
 };
 
 #endif
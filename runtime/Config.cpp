@@ -36,6 +36,40 @@ bool checkFlagString(std::string value) {
   throw std::runtime_error(msg.str());
 }
 
+/// Parse a memory size given in MiB, or with an explicit unit (K, M, or G).
+size_t parseMemorySize(const std::string &value) {
+  size_t number, unitIndex;
+  try {
+    number = std::stoul(value, &unitIndex);
+  } catch (std::logic_error &) {
+    std::stringstream msg;
+    msg << "Can't convert " << value << " to a memory size";
+    throw std::runtime_error(msg.str());
+  }
+
+  auto unit = value.substr(unitIndex);
+  unsigned shift;
+  if (unit == "K" || unit == "k")
+    shift = 10;
+  else if (unit.empty() || unit == "M" || unit == "m")
+    shift = 20;
+  else if (unit == "G" || unit == "g")
+    shift = 30;
+  else {
+    std::stringstream msg;
+    msg << "Unknown unit " << unit << " in memory size " << value;
+    throw std::runtime_error(msg.str());
+  }
+
+  if (number > (std::numeric_limits<size_t>::max() >> shift)) {
+    std::stringstream msg;
+    msg << "The memory size " << value << " is too large";
+    throw std::runtime_error(msg.str());
+  }
+
+  return number << shift;
+}
+
 } // namespace
 
 Config g_config;
@@ -65,6 +99,10 @@ void loadConfig() {
   if (aflCoverageMap != nullptr)
     g_config.aflCoverageMap = aflCoverageMap;
 
+  auto *printStatistics = getenv("SYMCC_STATISTICS");
+  if (printStatistics != nullptr)
+    g_config.printStatistics = checkFlagString(printStatistics);
+
   auto *garbageCollectionThreshold = getenv("SYMCC_GC_THRESHOLD");
   if (garbageCollectionThreshold != nullptr) {
     try {
@@ -80,4 +118,8 @@ void loadConfig() {
       throw std::runtime_error(msg.str());
     }
   }
+
+  auto *memoryLimit = getenv("SYMCC_MEMORY_LIMIT");
+  if (memoryLimit != nullptr)
+    g_config.memoryLimit = parseMemorySize(memoryLimit);
 }
@@ -50,6 +50,17 @@ struct Config {
   /// 2GB on most workloads because requiring that amount of memory per core
   /// participating in the analysis seems reasonable.
   size_t garbageCollectionThreshold = 5'000'000;
+
+  /// The memory budget in bytes (or 0 for none).
+  ///
+  /// If set, the garbage collector ignores garbageCollectionThreshold and
+  /// decides when to collect based on how much memory the program uses. When
+  /// collecting garbage isn't enough to stay within the budget, it concretizes
+  /// shadow memory rather than letting the program run out of memory.
+  size_t memoryLimit = 0;
+
+  /// Should we print statistics on memory usage when the program exits?
+  bool printStatistics = false;
 };
 
 /// The global configuration object.
@@ -0,0 +1,38 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#include "Constants.h"
+
+#include "GarbageCollection.h"
+
+std::array<SymExpr, 256> g_byte_constants;
+std::array<SymExpr, 12> g_small_constants;
+
+void initConstantExpressions() {
+  for (unsigned value = 0; value < g_byte_constants.size(); value++)
+    g_byte_constants[value] = _sym_build_integer(value, 8);
+
+  const uint8_t widths[] = {1, 16, 32, 64};
+  for (size_t i = 0; i < 4; i++) {
+    g_small_constants[3 * i] = _sym_build_integer(0, widths[i]);
+    g_small_constants[3 * i + 1] = _sym_build_integer(1, widths[i]);
+    g_small_constants[3 * i + 2] = _sym_build_integer(~UINT64_C(0), widths[i]);
+  }
+
+  // The garbage collector treats the tables as roots, so the constants stay
+  // alive forever.
+  registerExpressionRegion({g_byte_constants.data(), g_byte_constants.size()});
+  registerExpressionRegion(
+      {g_small_constants.data(), g_small_constants.size()});
+}
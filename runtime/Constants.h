@@ -0,0 +1,85 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef CONSTANTS_H
+#define CONSTANTS_H
+
+#include <array>
+#include <cstdint>
+
+#include <Runtime.h>
+
+//
+// Some constant expressions are needed all the time: every concrete byte that
+// is mixed into a symbolic read becomes an 8-bit constant, and the compiler
+// pass as well as the libc models build lots of zeros and ones. We create
+// these expressions once at startup and keep them forever (i.e., the garbage
+// collector never releases them), so that requesting them doesn't allocate
+// anything.
+//
+
+/// The constant expressions for all byte values.
+extern std::array<SymExpr, 256> g_byte_constants;
+
+/// The constant expressions for 0, 1 and -1 at 1, 16, 32 and 64 bits (in this
+/// order, three per width); g_byte_constants covers 8 bits.
+extern std::array<SymExpr, 12> g_small_constants;
+
+/// Build the pinned constants.
+///
+/// The backend needs to be ready to create expressions. Until this function
+/// has been called, the lookup functions below return null.
+void initConstantExpressions();
+
+/// Return the pinned expression for the given byte value.
+inline SymExpr byteConstant(uint8_t value) { return g_byte_constants[value]; }
+
+/// Return the pinned expression for a constant, or null if we don't pin that
+/// particular constant.
+inline SymExpr lookupConstantExpression(uint64_t value, uint8_t bits) {
+  if (bits == 8)
+    return byteConstant(static_cast<uint8_t>(value));
+
+  size_t widthIndex;
+  switch (bits) {
+  case 1:
+    widthIndex = 0;
+    break;
+  case 16:
+    widthIndex = 1;
+    break;
+  case 32:
+    widthIndex = 2;
+    break;
+  case 64:
+    widthIndex = 3;
+    break;
+  default:
+    return nullptr;
+  }
+
+  // Callers don't always truncate the value to the requested width.
+  uint64_t mask = (bits == 64) ? ~UINT64_C(0) : (UINT64_C(1) << bits) - 1;
+  value &= mask;
+
+  if (value == 0)
+    return g_small_constants[3 * widthIndex];
+  if (value == 1)
+    return g_small_constants[3 * widthIndex + 1];
+  if (value == mask)
+    return g_small_constants[3 * widthIndex + 2];
+  return nullptr;
+}
+
+#endif
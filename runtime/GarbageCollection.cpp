@@ -14,36 +14,433 @@
 
 #include "GarbageCollection.h"
 
+#include <atomic>
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 #include <vector>
 
+#include <malloc.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <Config.h>
 #include <Runtime.h>
 #include <Shadow.h>
+#include <Threads.h>
+
+namespace {
+
+/// The number of minor collections that the young generation should be able
+/// to trigger before the threshold is reached again.
+constexpr size_t kMinorCollectionsPerThreshold = 4;
+
+/// The number of new expressions between two measurements of the memory usage
+/// (only relevant if there is a memory budget).
+constexpr size_t kExpressionsPerMemoryCheck = 10'000;
+
+/// Statistics on the garbage collector, also used for scheduling.
+struct GarbageCollectionStatistics {
+  size_t minorCollections = 0;
+  size_t majorCollections = 0;
+  std::chrono::steady_clock::duration totalPause{};
+  std::chrono::steady_clock::duration longestPause{};
+
+  /// The number of expressions that survived the last major collection.
+  size_t majorSurvivors = 0;
+
+  /// The size of the young generation at which we measure the memory usage
+  /// next. Threads read it without the symbolic lock.
+  std::atomic<size_t> nextMemoryCheck{kExpressionsPerMemoryCheck};
+
+  /// The highest memory usage that we have measured.
+  size_t peakMemoryUsage = 0;
+
+  /// The memory usage right after the last major collection.
+  size_t memoryUsageAfterMajor = 0;
+
+  /// The number of times that we had to concretize shadow memory.
+  size_t emergencies = 0;
+} g_gc_statistics;
+
+/// Determine how much memory the program uses.
+size_t currentMemoryUsage() {
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 33)
+  // Ask the allocator if possible: memory that we release doesn't necessarily
+  // go back to the operating system, so the resident set size would stay high
+  // even after a successful collection.
+  auto info = mallinfo2();
+  return info.uordblks + info.hblkhd;
+#endif
+#endif
+
+  // Otherwise, fall back to the resident set size.
+  size_t pages = 0, residentPages = 0;
+  if (auto *statm = fopen("/proc/self/statm", "r")) {
+    if (fscanf(statm, "%zu %zu", &pages, &residentPages) != 2)
+      residentPages = 0;
+    fclose(statm);
+  }
+
+  return residentPages * sysconf(_SC_PAGESIZE);
+}
+
+/// Decide whether to collect garbage based on the memory budget.
+GarbageCollection scheduleByMemoryUsage(size_t youngExpressions) {
+  // Measuring the memory usage isn't free, and memory only grows when the
+  // program creates new expressions.
+  if (youngExpressions <
+      g_gc_statistics.nextMemoryCheck.load(std::memory_order_relaxed))
+    return GarbageCollection::None;
+  g_gc_statistics.nextMemoryCheck.store(
+      youngExpressions + kExpressionsPerMemoryCheck, std::memory_order_relaxed);
+
+  auto usage = currentMemoryUsage();
+  g_gc_statistics.peakMemoryUsage =
+      std::max(g_gc_statistics.peakMemoryUsage, usage);
+
+  auto limit = g_config.memoryLimit;
+  if (usage < limit / 2)
+    return GarbageCollection::None;
+  if (usage < limit / 4 * 3)
+    return GarbageCollection::Minor;
+
+  // Another major collection is pointless if memory usage hasn't grown
+  // much since the last one. (Neither the backends nor the allocator
+  // necessarily return memory that they have released, so we may never get
+  // below the thresholds again.)
+  if (usage < g_gc_statistics.memoryUsageAfterMajor + limit / 10)
+    return GarbageCollection::Minor;
+
+  // If even the last major collection didn't get us away from the limit, the
+  // program holds on to too many expressions.
+  if (usage >= limit / 10 * 9 &&
+      g_gc_statistics.memoryUsageAfterMajor >= limit / 4 * 3)
+    return GarbageCollection::Emergency;
+
+  return GarbageCollection::Major;
+}
+
+/// Mark all memory as concrete.
+void concretizeShadowMemory() {
+  if (g_gc_statistics.emergencies == 0)
+    std::cerr << "Warning: running out of memory, concretizing all symbolic "
+                 "data in memory"
+              << std::endl;
+
+  std::vector<uintptr_t> pages;
+  forEachShadowPage(
+      [&](uintptr_t page, ShadowPage *) { pages.push_back(page); });
+  for (auto page : pages)
+    clearShadow(page, kPageSize);
+}
 
 /// A list of memory regions that are known to contain symbolic expressions.
-std::vector<ExpressionRegion> expressionRegions;
+///
+/// Regions may be registered during static initialization, so we construct
+/// the list on first use.
+std::vector<ExpressionRegion> &expressionRegions() {
+  static std::vector<ExpressionRegion> regions;
+  return regions;
+}
+
+/// Functions returning the current thread's instance of thread-local regions
+/// that contain symbolic expressions.
+std::vector<ExpressionRegion (*)()> &threadLocalExpressionRegions() {
+  static std::vector<ExpressionRegion (*)()> regions;
+  return regions;
+}
+
+/// Treat every word on the stack as a potential symbolic expression.
+///
+/// Instrumented code keeps the expressions of its SSA values in registers and
+/// stack slots that we can't enumerate precisely. However, the garbage
+/// collector only runs at safe points, i.e., when instrumented code calls into
+/// the run-time library, so any live value is either on the stack or in a
+/// callee-saved register. We spill the latter to the stack, and then scan the
+/// stack conservatively: words that aren't expressions are harmless because
+/// the backends only release expressions that they allocated.
+__attribute__((noinline, no_sanitize_address)) void
+collectStackRoots(ReachableExpressions &reachableExpressions) {
+  static thread_local const uintptr_t stackEnd = findCurrentStack().second;
+
+  __builtin_unwind_init();
+  jmp_buf registers;
+  setjmp(registers);
+
+  auto current = reinterpret_cast<uintptr_t>(&registers);
+  current = (current + alignof(SymExpr) - 1) & ~(alignof(SymExpr) - 1);
+  for (auto *word = reinterpret_cast<SymExpr *>(current);
+       reinterpret_cast<uintptr_t>(word) < stackEnd; word++) {
+    if (*word != nullptr)
+      reachableExpressions.insert(*word);
+  }
+}
+
+//
+// Other symbolic threads don't stop at safe points, and they may hold
+// expressions anywhere in their registers, on their stacks and in their
+// thread-local storage. We send each of them a signal, and the handler copies
+// all of that to fresh memory; the kernel has saved the interrupted code's
+// registers on the stack before running the handler. The thread continues
+// right away: we hold the symbolic lock until the end of the collection, and
+// without it the thread can only move the expressions that it already has,
+// so the copy contains all expressions that the thread can use afterwards.
+//
+
+/// The signal that asks a thread for a copy of its roots (as in the Boehm
+/// garbage collector). Its delivery interrupts some system calls (e.g., poll)
+/// with EINTR.
+constexpr int kSnapshotSignal = SIGPWR;
+
+/// The thread that kSnapshotSignal is meant for.
+std::atomic<const SymbolicThread *> g_snapshot_thread;
+
+/// The copy of the roots that the signal handler creates, or nullptr if it
+/// couldn't create one.
+std::atomic<SymExpr *> g_snapshot;
+size_t g_snapshot_size;
+
+/// Posted by the signal handler when it is done.
+sem_t g_snapshot_taken;
+
+__attribute__((no_sanitize_address)) void takeSnapshot(int) {
+  auto savedErrno = errno;
+  const auto *thread = g_snapshot_thread.load(std::memory_order_acquire);
+
+  // We only scan the part of the stack above the handler's frame, which
+  // includes the signal frame. The handler may be running on an alternate
+  // signal stack if the program's own handler was interrupted; we can't find
+  // the thread's roots then.
+  SymExpr *snapshot = nullptr;
+  auto current = reinterpret_cast<uintptr_t>(&snapshot);
+  current = (current + alignof(SymExpr) - 1) & ~(alignof(SymExpr) - 1);
+  if (thread != nullptr && current >= thread->stackBegin &&
+      current < thread->stackEnd) {
+    // The accessors of thread-local regions only compute addresses, so they
+    // are safe to call from a signal handler.
+    auto stackWords = (thread->stackEnd - current) / sizeof(SymExpr);
+    auto size = stackWords;
+    for (auto *region : threadLocalExpressionRegions())
+      size += region().second;
+
+    auto *memory = mmap(nullptr, size * sizeof(SymExpr),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (memory != MAP_FAILED) {
+      snapshot = static_cast<SymExpr *>(memory);
+      memcpy(snapshot, reinterpret_cast<SymExpr *>(current),
+             stackWords * sizeof(SymExpr));
+      auto *next = snapshot + stackWords;
+      for (auto *region : threadLocalExpressionRegions()) {
+        auto [start, length] = region();
+        memcpy(next, start, length * sizeof(SymExpr));
+        next += length;
+      }
+      g_snapshot_size = size;
+    }
+  }
+
+  g_snapshot.store(snapshot, std::memory_order_release);
+  sem_post(&g_snapshot_taken);
+  errno = savedErrno;
+}
+
+/// Collect the roots of all symbolic threads other than the current one.
+///
+/// The caller must hold the symbolic lock. Returns false if we couldn't get
+/// the roots of all threads.
+bool collectOtherThreadRoots(ReachableExpressions &reachableExpressions) {
+  static bool handlerInstalled = false;
+  auto self = pthread_self();
+
+  for (const auto *thread : symbolicThreads()) {
+    if (pthread_equal(thread->handle, self))
+      continue;
+
+    if (!handlerInstalled) {
+      sem_init(&g_snapshot_taken, 0, 0);
+      struct sigaction action = {};
+      action.sa_handler = takeSnapshot;
+      action.sa_flags = SA_RESTART;
+      sigfillset(&action.sa_mask);
+      if (sigaction(kSnapshotSignal, &action, nullptr) != 0) {
+        perror("Failed to install the garbage collector's signal handler");
+        exit(-1);
+      }
+      handlerInstalled = true;
+    }
+
+    g_snapshot_thread.store(thread, std::memory_order_release);
+    if (int error = pthread_kill(thread->handle, kSnapshotSignal);
+        error != 0) {
+      errno = error;
+      perror("Failed to signal a thread for garbage collection");
+      exit(-1);
+    }
+    while (sem_wait(&g_snapshot_taken) != 0) {
+      if (errno != EINTR) {
+        perror("Failed to wait for a thread's garbage-collection roots");
+        exit(-1);
+      }
+    }
+
+    auto *snapshot = g_snapshot.load(std::memory_order_acquire);
+    if (snapshot == nullptr)
+      return false;
+
+    for (size_t i = 0; i < g_snapshot_size; i++) {
+      if (snapshot[i] != nullptr)
+        reachableExpressions.insert(snapshot[i]);
+    }
+    munmap(snapshot, g_snapshot_size * sizeof(SymExpr));
+  }
+
+  return true;
+}
+
+} // namespace
 
 void registerExpressionRegion(ExpressionRegion r) {
-  expressionRegions.push_back(std::move(r));
+  expressionRegions().push_back(std::move(r));
+}
+
+void registerThreadLocalExpressionRegion(ExpressionRegion (*region)()) {
+  threadLocalExpressionRegions().push_back(region);
 }
 
-std::set<SymExpr> collectReachableExpressions() {
-  std::set<SymExpr> reachableExpressions;
+std::optional<ReachableExpressions>
+collectReachableExpressions(GarbageCollection kind) {
+  ReachableExpressions reachableExpressions;
+  if (!collectOtherThreadRoots(reachableExpressions))
+    return std::nullopt;
+
+  if (kind == GarbageCollection::Emergency)
+    concretizeShadowMemory();
+
   auto collectReachableExpressions = [&](ExpressionRegion r) {
-    auto *end = r.first + r.second;
-    for (SymExpr *expr_ptr = r.first; expr_ptr < end; expr_ptr++) {
-      if (*expr_ptr != nullptr) {
-        reachableExpressions.insert(*expr_ptr);
-      }
+    const SymExpr *end = r.first + r.second;
+    for (auto *expr_ptr = findSymbolicExpression(r.first, end); expr_ptr < end;
+         expr_ptr = findSymbolicExpression(expr_ptr + 1, end)) {
+      reachableExpressions.insert(*expr_ptr);
     }
   };
 
-  for (auto &r : expressionRegions) {
+  for (auto &r : expressionRegions()) {
     collectReachableExpressions(r);
   }
 
-  for (const auto &mapping : g_shadow_pages) {
-    collectReachableExpressions({mapping.second, kPageSize});
-  }
+  for (auto *region : threadLocalExpressionRegions())
+    collectReachableExpressions(region());
+
+  collectStackRoots(reachableExpressions);
+
+  forEachShadowPage([&](uintptr_t, ShadowPage *shadow) {
+    // Pages that haven't been written since the last collection can only
+    // contain old expressions.
+    if (kind == GarbageCollection::Minor && !shadow->dirty)
+      return;
+    shadow->dirty = false;
 
+    // Only look at the expressions that the bitmap marks as symbolic.
+    for (size_t word = 0; word < ShadowPage::kBitmapWords; word++) {
+      for (auto bits = shadow->symbolicBits[word]; bits != 0;
+           bits &= bits - 1) {
+        reachableExpressions.insert(
+            shadow->expressions[word * 64 + __builtin_ctzll(bits)]);
+      }
+    }
+
+    if (shadow->wordExpressions != nullptr)
+      collectReachableExpressions(
+          {shadow->wordExpressions, ShadowPage::kWordExpressions});
+  });
+
+  reachableExpressions.finalize();
   return reachableExpressions;
 }
+
+GarbageCollection scheduleGarbageCollection(size_t allocatedExpressions,
+                                            size_t youngExpressions) {
+  if (g_config.memoryLimit != 0)
+    return scheduleByMemoryUsage(youngExpressions);
+
+  auto threshold = g_config.garbageCollectionThreshold;
+
+  // If the program keeps more than the threshold alive, we still want each
+  // collection to be paid for by a reasonable number of new expressions.
+  if (allocatedExpressions < threshold ||
+      youngExpressions < threshold / kMinorCollectionsPerThreshold)
+    return GarbageCollection::None;
+
+  // Collect old expressions when the old generation has doubled since the last
+  // major collection.
+  auto oldExpressions = allocatedExpressions - youngExpressions;
+  if (oldExpressions >=
+      std::max(threshold / 2, 2 * g_gc_statistics.majorSurvivors))
+    return GarbageCollection::Major;
+
+  return GarbageCollection::Minor;
+}
+
+bool mayNeedGarbageCollection(size_t youngExpressions) {
+  if (g_config.memoryLimit != 0)
+    return youngExpressions >=
+           g_gc_statistics.nextMemoryCheck.load(std::memory_order_relaxed);
+
+  return youngExpressions >=
+         g_config.garbageCollectionThreshold / kMinorCollectionsPerThreshold;
+}
+
+void recordGarbageCollection(GarbageCollection kind,
+                             size_t allocatedExpressions,
+                             std::chrono::steady_clock::duration pause) {
+  if (kind == GarbageCollection::Minor) {
+    g_gc_statistics.minorCollections++;
+  } else {
+    g_gc_statistics.majorCollections++;
+    g_gc_statistics.majorSurvivors = allocatedExpressions;
+  }
+
+  if (kind == GarbageCollection::Emergency)
+    g_gc_statistics.emergencies++;
+
+  g_gc_statistics.nextMemoryCheck.store(kExpressionsPerMemoryCheck,
+                                        std::memory_order_relaxed);
+  if (g_config.memoryLimit != 0 && kind != GarbageCollection::Minor)
+    g_gc_statistics.memoryUsageAfterMajor = currentMemoryUsage();
+
+  g_gc_statistics.totalPause += pause;
+  g_gc_statistics.longestPause = std::max(g_gc_statistics.longestPause, pause);
+}
+
+void printGarbageCollectionStatistics(size_t allocatedExpressions) {
+  using milliseconds = std::chrono::duration<double, std::milli>;
+
+  std::cerr << "Symbolic expressions: " << allocatedExpressions << " live, "
+            << g_gc_statistics.minorCollections +
+                   g_gc_statistics.majorCollections
+            << " garbage collections (" << g_gc_statistics.minorCollections
+            << " minor, " << g_gc_statistics.majorCollections << " major)"
+            << std::endl
+            << "Garbage collection pauses: "
+            << milliseconds(g_gc_statistics.totalPause).count()
+            << " ms in total, longest "
+            << milliseconds(g_gc_statistics.longestPause).count() << " ms"
+            << std::endl;
+
+  if (g_config.memoryLimit != 0) {
+    auto mib = [](size_t bytes) { return bytes >> 20; };
+    std::cerr << "Memory budget: " << mib(g_config.memoryLimit)
+              << " MiB, peak usage " << mib(g_gc_statistics.peakMemoryUsage)
+              << " MiB, shadow memory concretized "
+              << g_gc_statistics.emergencies << " times" << std::endl;
+  }
+}
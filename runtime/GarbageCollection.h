@@ -15,11 +15,35 @@
 #ifndef GARBAGECOLLECTION_H
 #define GARBAGECOLLECTION_H
 
+#include <algorithm>
+#include <chrono>
+#include <optional>
 #include <utility>
-#include <set>
+#include <vector>
 
 #include <Runtime.h>
 
+//
+// The garbage collector is generational. Expressions are immutable and can
+// only refer to older expressions, and the backends keep the operands of an
+// expression alive for as long as the expression itself. A collection thus
+// only needs to find the expressions that the program can still reach
+// directly, and it doesn't need to trace through expressions.
+//
+// Most expressions die young (think of temporaries in a loop), so most
+// collections are minor: they only consider the expressions created since the
+// previous collection, and they only scan the shadow pages that have been
+// written since then. Expressions that survive a collection become old, and
+// only major collections, which scan all roots, can release them. The
+// backends keep track of the young generation and ask scheduleGarbageCollection
+// which kind of collection to perform.
+//
+// If the user gives us a memory budget, minor collections start when half of
+// it is used, and major collections when three quarters are used. If that
+// doesn't help, we sacrifice precision: we concretize all of shadow memory so
+// that most expressions become garbage.
+//
+
 /// An imitation of std::span (which is not available before C++20) for symbolic
 /// expressions.
 using ExpressionRegion = std::pair<SymExpr *, size_t>;
@@ -28,7 +52,97 @@ using ExpressionRegion = std::pair<SymExpr *, size_t>;
 /// expressions.
 void registerExpressionRegion(ExpressionRegion r);
 
+/// Like registerExpressionRegion, but for thread-local storage: the given
+/// function returns the calling thread's instance of the region.
+void registerThreadLocalExpressionRegion(ExpressionRegion (*region)());
+
+enum class GarbageCollection {
+  /// Nothing to do.
+  None,
+
+  /// Only collect young expressions.
+  Minor,
+
+  /// Collect all expressions.
+  Major,
+
+  /// Concretize all of shadow memory, then collect all expressions. This is
+  /// the last resort when the program is about to exceed its memory budget.
+  Emergency
+};
+
+/// The set of expressions found during a collection.
+///
+/// Building a tree-based set would dominate the cost of collections, so we
+/// collect the expressions in a vector and sort it once we're done.
+class ReachableExpressions {
+public:
+  void insert(SymExpr expr) {
+    // Shadow memory often contains runs of the same expression.
+    if (expressions_.empty() || expressions_.back() != expr)
+      expressions_.push_back(expr);
+  }
+
+  /// Prepare for lookups; no more insertions are allowed afterwards.
+  void finalize() {
+    std::sort(expressions_.begin(), expressions_.end());
+    expressions_.erase(std::unique(expressions_.begin(), expressions_.end()),
+                       expressions_.end());
+  }
+
+  bool contains(SymExpr expr) const {
+    return std::binary_search(expressions_.begin(), expressions_.end(), expr);
+  }
+
+private:
+  std::vector<SymExpr> expressions_;
+};
+
 /// Return the set of currently reachable symbolic expressions.
-std::set<SymExpr> collectReachableExpressions();
+///
+/// This includes anything that looks like an expression on the stacks of
+/// symbolic threads, so the result may contain pointers that aren't
+/// expressions. It must only be called from code that instrumented programs
+/// call directly (e.g., _sym_collect_garbage), so that the current thread's
+/// stack contains all expressions held by the thread, and the caller must hold
+/// the symbolic lock (see Threads.h).
+///
+/// For a minor collection, the result only contains the expressions that are
+/// reachable from shadow pages written since the previous collection, which
+/// includes all reachable young expressions.
+///
+/// If we can't find the roots of another symbolic thread (e.g., because it is
+/// running a signal handler on an alternate stack), there is no result, and
+/// the caller must not release any expressions.
+std::optional<ReachableExpressions>
+collectReachableExpressions(GarbageCollection kind);
+
+/// Decide whether to collect garbage now, given the total number of
+/// expressions that the backend keeps alive and how many of them were created
+/// since the previous collection.
+///
+/// Without a memory budget (see Config::memoryLimit), this is based on the
+/// number of expressions; otherwise, we periodically measure the memory usage
+/// and collect more aggressively the closer it gets to the budget.
+GarbageCollection scheduleGarbageCollection(size_t allocatedExpressions,
+                                            size_t youngExpressions);
+
+/// Check whether scheduleGarbageCollection may decide to collect, given the
+/// number of expressions created since the previous collection.
+///
+/// Instrumented code asks for collections at every function entry and loop
+/// head, so the backends use this to avoid taking the symbolic lock in the
+/// common case. It doesn't need the lock, but the answer may be outdated.
+bool mayNeedGarbageCollection(size_t youngExpressions);
+
+/// Record a finished collection, which left the given number of expressions
+/// alive.
+void recordGarbageCollection(GarbageCollection kind,
+                             size_t allocatedExpressions,
+                             std::chrono::steady_clock::duration pause);
+
+/// Print the number of live expressions and statistics on the collections to
+/// stderr.
+void printGarbageCollectionStatistics(size_t allocatedExpressions);
 
 #endif
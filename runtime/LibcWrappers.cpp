@@ -12,6 +12,7 @@
 // You should have received a copy of the GNU General Public License along with
 // SymCC. If not, see <https://www.gnu.org/licenses/>.
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -22,12 +23,14 @@
 
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "Config.h"
 #include "Shadow.h"
+#include "Threads.h"
 #include <Runtime.h>
 
 #define SYM(x) x##_symbolized
@@ -35,9 +38,13 @@
 namespace {
 
 /// The file descriptor referring to the symbolic input.
-int inputFileDescriptor = -1;
+///
+/// Every I/O wrapper compares against it, so it's atomic rather than protected
+/// by the symbolic lock; threads doing concrete I/O don't need to synchronize.
+std::atomic<int> inputFileDescriptor = -1;
 
-/// The current position in the (symbolic) input.
+/// The current position in the (symbolic) input (protected by the symbolic
+/// lock).
 uint64_t inputOffset = 0;
 
 /// Tell the solver to try an alternative value than the given one.
@@ -107,12 +114,40 @@ void *SYM(mmap)(void *addr, size_t len, int prot, int flags, int fildes,
   return SYM(mmap64)(addr, len, prot, flags, fildes, off);
 }
 
+// When memory is released, forget about its symbolic contents. Otherwise, the
+// shadow would stay around forever and might even leak into new allocations
+// that happen to reuse the memory.
+
+void SYM(free)(void *ptr) {
+  if (ptr != nullptr) {
+    auto size = malloc_usable_size(ptr);
+    if (hasShadow(ptr, size)) {
+      SymbolicLock lock;
+      clearShadow(reinterpret_cast<uintptr_t>(ptr), size);
+    }
+  }
+  free(ptr);
+}
+
+int SYM(munmap)(void *addr, size_t len) {
+  auto result = munmap(addr, len);
+  _sym_set_return_expression(nullptr);
+
+  if (result == 0 && hasShadow(addr, len)) {
+    SymbolicLock lock;
+    clearShadow(reinterpret_cast<uintptr_t>(addr), len);
+  }
+
+  return result;
+}
+
 int SYM(open)(const char *path, int oflag, mode_t mode) {
   auto result = open(path, oflag, mode);
   _sym_set_return_expression(nullptr);
 
   if (result >= 0 && !g_config.fullyConcrete && !g_config.inputFile.empty() &&
       strstr(path, g_config.inputFile.c_str()) != nullptr) {
+    SymbolicLock lock;
     if (inputFileDescriptor != -1)
       std::cerr << "Warning: input file opened multiple times; this is not yet "
                    "supported"
@@ -136,12 +171,13 @@ ssize_t SYM(read)(int fildes, void *buf, size_t nbyte) {
 
   if (fildes == inputFileDescriptor) {
     // Reading symbolic input.
+    SymbolicLock lock;
     ReadWriteShadow shadow(buf, result);
     std::generate(shadow.begin(), shadow.end(),
                   []() { return _sym_get_input_byte(inputOffset++); });
   } else if (!isConcrete(buf, result)) {
-    ReadWriteShadow shadow(buf, result);
-    std::fill(shadow.begin(), shadow.end(), nullptr);
+    SymbolicLock lock;
+    clearShadow(reinterpret_cast<uintptr_t>(buf), result);
   }
 
   return result;
@@ -170,8 +206,10 @@ uint64_t SYM(lseek64)(int fd, uint64_t offset, int whence) {
   if (whence == SEEK_SET)
     _sym_set_return_expression(_sym_get_parameter_expression(1));
 
-  if (fd == inputFileDescriptor)
+  if (fd == inputFileDescriptor) {
+    SymbolicLock lock;
     inputOffset = result;
+  }
 
   return result;
 }
@@ -196,6 +234,7 @@ FILE *SYM(fopen)(const char *pathname, const char *mode) {
   if (result != nullptr && !g_config.fullyConcrete &&
       !g_config.inputFile.empty() &&
       strstr(pathname, g_config.inputFile.c_str()) != nullptr) {
+    SymbolicLock lock;
     if (inputFileDescriptor != -1)
       std::cerr << "Warning: input file opened multiple times; this is not yet "
                    "supported"
@@ -214,6 +253,7 @@ FILE *SYM(fopen64)(const char *pathname, const char *mode) {
   if (result != nullptr && !g_config.fullyConcrete &&
       !g_config.inputFile.empty() &&
       strstr(pathname, g_config.inputFile.c_str()) != nullptr) {
+    SymbolicLock lock;
     if (inputFileDescriptor != -1)
       std::cerr << "Warning: input file opened multiple times; this is not yet "
                    "supported"
@@ -235,12 +275,13 @@ size_t SYM(fread)(void *ptr, size_t size, size_t nmemb, FILE *stream) {
 
   if (fileno(stream) == inputFileDescriptor) {
     // Reading symbolic input.
+    SymbolicLock lock;
     ReadWriteShadow shadow(ptr, result * size);
     std::generate(shadow.begin(), shadow.end(),
                   []() { return _sym_get_input_byte(inputOffset++); });
   } else if (!isConcrete(ptr, result * size)) {
-    ReadWriteShadow shadow(ptr, result * size);
-    std::fill(shadow.begin(), shadow.end(), nullptr);
+    SymbolicLock lock;
+    clearShadow(reinterpret_cast<uintptr_t>(ptr), result * size);
   }
 
   return result;
@@ -255,12 +296,13 @@ char *SYM(fgets)(char *str, int n, FILE *stream) {
 
   if (fileno(stream) == inputFileDescriptor) {
     // Reading symbolic input.
+    SymbolicLock lock;
     ReadWriteShadow shadow(str, sizeof(char) * strlen(str));
     std::generate(shadow.begin(), shadow.end(),
                   []() { return _sym_get_input_byte(inputOffset++); });
   } else if (!isConcrete(str, sizeof(char) * strlen(str))) {
-    ReadWriteShadow shadow(str, sizeof(char) * strlen(str));
-    std::fill(shadow.begin(), shadow.end(), nullptr);
+    SymbolicLock lock;
+    clearShadow(reinterpret_cast<uintptr_t>(str), sizeof(char) * strlen(str));
   }
 
   return result;
@@ -271,6 +313,7 @@ void SYM(rewind)(FILE *stream) {
   _sym_set_return_expression(nullptr);
 
   if (fileno(stream) == inputFileDescriptor) {
+    SymbolicLock lock;
     inputOffset = 0;
   }
 }
@@ -287,6 +330,7 @@ int SYM(fseek)(FILE *stream, long offset, int whence) {
     auto pos = ftell(stream);
     if (pos == -1)
       return -1;
+    SymbolicLock lock;
     inputOffset = pos;
   }
 
@@ -305,6 +349,7 @@ int SYM(fseeko)(FILE *stream, off_t offset, int whence) {
     auto pos = ftello(stream);
     if (pos == -1)
       return -1;
+    SymbolicLock lock;
     inputOffset = pos;
   }
 
@@ -323,6 +368,7 @@ int SYM(fseeko64)(FILE *stream, uint64_t offset, int whence) {
     auto pos = ftello64(stream);
     if (pos == -1)
       return -1;
+    SymbolicLock lock;
     inputOffset = pos;
   }
 
@@ -336,11 +382,13 @@ int SYM(getc)(FILE *stream) {
     return result;
   }
 
-  if (fileno(stream) == inputFileDescriptor)
+  if (fileno(stream) == inputFileDescriptor) {
+    SymbolicLock lock;
     _sym_set_return_expression(_sym_build_zext(
         _sym_get_input_byte(inputOffset++), sizeof(int) * 8 - 8));
-  else
+  } else {
     _sym_set_return_expression(nullptr);
+  }
 
   return result;
 }
@@ -352,11 +400,13 @@ int SYM(fgetc)(FILE *stream) {
     return result;
   }
 
-  if (fileno(stream) == inputFileDescriptor)
+  if (fileno(stream) == inputFileDescriptor) {
+    SymbolicLock lock;
     _sym_set_return_expression(_sym_build_zext(
         _sym_get_input_byte(inputOffset++), sizeof(int) * 8 - 8));
-  else
+  } else {
     _sym_set_return_expression(nullptr);
+  }
 
   return result;
 }
@@ -369,8 +419,10 @@ int SYM(ungetc)(int c, FILE *stream) {
   auto result = ungetc(c, stream);
   _sym_set_return_expression(_sym_get_parameter_expression(0));
 
-  if (fileno(stream) == inputFileDescriptor && result != EOF)
+  if (fileno(stream) == inputFileDescriptor && result != EOF) {
+    SymbolicLock lock;
     inputOffset--;
+  }
 
   return result;
 }
@@ -425,14 +477,11 @@ char *SYM(strncpy)(char *dest, const char *src, size_t n) {
   if (isConcrete(src, copied) && isConcrete(dest, n))
     return result;
 
-  auto srcShadow = ReadOnlyShadow(src, copied);
-  auto destShadow = ReadWriteShadow(dest, n);
-
-  std::copy(srcShadow.begin(), srcShadow.end(), destShadow.begin());
-  if (copied < n) {
-    ReadWriteShadow destRestShadow(dest + copied, n - copied);
-    std::fill(destRestShadow.begin(), destRestShadow.end(), nullptr);
-  }
+  SymbolicLock lock;
+  copyShadow(reinterpret_cast<uintptr_t>(dest),
+             reinterpret_cast<uintptr_t>(src), copied);
+  if (copied < n)
+    clearShadow(reinterpret_cast<uintptr_t>(dest + copied), n - copied);
 
   return result;
 }
@@ -449,6 +498,7 @@ const char *SYM(strchr)(const char *s, int c) {
       cExpr == nullptr)
     return result;
 
+  SymbolicLock lock;
   if (cExpr == nullptr)
     cExpr = _sym_build_integer(c, 8);
   else
@@ -480,6 +530,7 @@ int SYM(memcmp)(const void *a, const void *b, size_t n) {
   if (isConcrete(a, n) && isConcrete(b, n))
     return result;
 
+  SymbolicLock lock;
   auto aShadowIt = ReadOnlyShadow(a, n).begin_non_null();
   auto bShadowIt = ReadOnlyShadow(b, n).begin_non_null();
   auto *allEqual = _sym_build_equal(*aShadowIt, *bShadowIt);
@@ -21,18 +21,76 @@
 #include "GarbageCollection.h"
 #include "RuntimeCommon.h"
 #include "Shadow.h"
-
-namespace {
+#include "Threads.h"
 
 constexpr int kMaxFunctionArguments = 256;
 
-/// Global storage for function parameters and the return value.
-SymExpr g_return_value;
-std::array<SymExpr, kMaxFunctionArguments> g_function_arguments;
-// TODO make thread-local
+/// Storage for function parameters and the return value.
+///
+/// Calls never cross threads, so each thread has its own copy and the
+/// accessors below don't need the symbolic lock. The variables have external
+/// linkage so that the accessors still work when the compiler pass inlines
+/// them into instrumented code (see RUNTIME_BITCODE in
+/// docs/Configuration.txt); the initial-exec model keeps the access cheap
+/// there and in the shared library.
+__attribute__((tls_model("initial-exec"))) thread_local SymExpr g_return_value;
+__attribute__((tls_model("initial-exec"))) thread_local std::array<
+    SymExpr, kMaxFunctionArguments>
+    g_function_arguments;
+
+namespace {
+
+/// Make the garbage collector aware of the storage.
+struct RegisterGlobalExpressions {
+  RegisterGlobalExpressions() {
+    registerThreadLocalExpressionRegion(
+        []() -> ExpressionRegion { return {&g_return_value, 1}; });
+    registerThreadLocalExpressionRegion([]() -> ExpressionRegion {
+      return {g_function_arguments.data(), g_function_arguments.size()};
+    });
+  }
+} g_register_global_expressions;
 
 } // namespace
 
+/// Call-stack notifications recorded by instrumented code that was compiled
+/// with -symcc-notifications=buffered. Each entry is a site ID with the kind of
+/// notification in the two least significant bits. The layout has to match the
+/// one in compiler/Runtime.h.
+__attribute__((tls_model("initial-exec"))) thread_local std::array<
+    uintptr_t, 1024>
+    g_notification_buffer;
+__attribute__((tls_model("initial-exec"))) thread_local size_t
+    g_notification_count;
+__attribute__((tls_model("initial-exec"))) thread_local size_t
+    g_processed_notifications;
+
+void drainNotifications() {
+  // The notifications don't involve expressions, so we don't need to count
+  // the thread as symbolic. Updating the index first keeps the backend from
+  // draining again.
+  std::lock_guard<std::recursive_mutex> lock(g_symbolic_lock);
+  auto first = g_processed_notifications;
+  g_processed_notifications = g_notification_count;
+  processNotifications(g_notification_buffer.data() + first,
+                       g_notification_count - first);
+}
+
+void _sym_flush_notifications(void) {
+  if (g_notification_count != g_processed_notifications)
+    drainNotifications();
+
+  g_notification_count = 0;
+  g_processed_notifications = 0;
+}
+
+void bufferNotification(uintptr_t siteId, NotificationKind kind) {
+  g_notification_buffer[g_notification_count++] =
+      (siteId & ~uintptr_t{3}) | kind;
+  if (g_notification_count == g_notification_buffer.size())
+    _sym_flush_notifications();
+}
+
 void _sym_set_return_expression(SymExpr expr) { g_return_value = expr; }
 
 SymExpr _sym_get_return_expression(void) {
@@ -54,29 +112,26 @@ void _sym_memcpy(uint8_t *dest, const uint8_t *src, size_t length) {
   if (isConcrete(src, length) && isConcrete(dest, length))
     return;
 
-  ReadOnlyShadow srcShadow(src, length);
-  ReadWriteShadow destShadow(dest, length);
-  std::copy(srcShadow.begin(), srcShadow.end(), destShadow.begin());
+  SymbolicLock lock;
+  copyShadow(reinterpret_cast<uintptr_t>(dest),
+             reinterpret_cast<uintptr_t>(src), length);
 }
 
 void _sym_memset(uint8_t *memory, SymExpr value, size_t length) {
   if ((value == nullptr) && isConcrete(memory, length))
     return;
 
-  ReadWriteShadow shadow(memory, length);
-  std::fill(shadow.begin(), shadow.end(), value);
+  SymbolicLock lock;
+  fillShadow(reinterpret_cast<uintptr_t>(memory), value, length);
 }
 
 void _sym_memmove(uint8_t *dest, const uint8_t *src, size_t length) {
   if (isConcrete(src, length) && isConcrete(dest, length))
     return;
 
-  ReadOnlyShadow srcShadow(src, length);
-  ReadWriteShadow destShadow(dest, length);
-  if (dest > src)
-    std::copy_backward(srcShadow.begin(), srcShadow.end(), destShadow.end());
-  else
-    std::copy(srcShadow.begin(), srcShadow.end(), destShadow.begin());
+  SymbolicLock lock;
+  copyShadow(reinterpret_cast<uintptr_t>(dest),
+             reinterpret_cast<uintptr_t>(src), length);
 }
 
 SymExpr _sym_read_memory(uint8_t *addr, size_t length, bool little_endian) {
@@ -93,6 +148,16 @@ SymExpr _sym_read_memory(uint8_t *addr, size_t length, bool little_endian) {
   if (isConcrete(addr, length))
     return nullptr;
 
+  SymbolicLock lock;
+
+  // If the value was written as a whole, we can reuse the original expression
+  // instead of assembling it from bytes.
+  if (little_endian) {
+    if (auto *wordExpr =
+            lookupWordExpression(reinterpret_cast<uintptr_t>(addr), length))
+      return wordExpr;
+  }
+
   ReadOnlyShadow shadow(addr, length);
   return std::accumulate(shadow.begin_non_null(), shadow.end_non_null(),
                          static_cast<SymExpr>(nullptr),
@@ -119,23 +184,28 @@ void _sym_write_memory(uint8_t *addr, size_t length, SymExpr expr,
   if (expr == nullptr && isConcrete(addr, length))
     return;
 
-  ReadWriteShadow shadow(addr, length);
+  SymbolicLock lock;
   if (expr == nullptr) {
-    std::fill(shadow.begin(), shadow.end(), nullptr);
+    clearShadow(reinterpret_cast<uintptr_t>(addr), length);
   } else {
+    ReadWriteShadow shadow(addr, length);
     size_t i = 0;
-    for (SymExpr &byteShadow : shadow) {
+    for (auto &&byteShadow : shadow) {
       byteShadow = little_endian
                        ? _sym_extract_helper(expr, 8 * (i + 1) - 1, 8 * i)
                        : _sym_extract_helper(expr, (length - i) * 8 - 1,
                                              (length - i - 1) * 8);
       i++;
     }
+
+    if (little_endian)
+      recordWordExpression(reinterpret_cast<uintptr_t>(addr), length, expr);
   }
 }
 
 SymExpr _sym_build_extract(SymExpr expr, uint64_t offset, uint64_t length,
                            bool little_endian) {
+  SymbolicLock lock;
   size_t totalBits = _sym_bits_helper(expr);
   assert((totalBits % 8 == 0) && "Aggregate type contains partial bytes");
 
@@ -158,6 +228,7 @@ SymExpr _sym_build_extract(SymExpr expr, uint64_t offset, uint64_t length,
 }
 
 SymExpr _sym_build_bswap(SymExpr expr) {
+  SymbolicLock lock;
   size_t bits = _sym_bits_helper(expr);
   assert((bits % 16 == 0) && "bswap is not applicable");
   return _sym_build_extract(expr, 0, bits / 8, true);
@@ -165,6 +236,7 @@ SymExpr _sym_build_bswap(SymExpr expr) {
 
 SymExpr _sym_build_insert(SymExpr target, SymExpr to_insert, uint64_t offset,
                           bool little_endian) {
+  SymbolicLock lock;
   size_t bitsToInsert = _sym_bits_helper(to_insert);
   assert((bitsToInsert % 8 == 0) &&
          "Expression to insert contains partial bytes");
@@ -194,5 +266,8 @@ SymExpr _sym_build_insert(SymExpr target, SymExpr to_insert, uint64_t offset,
 }
 
 void _sym_register_expression_region(SymExpr *start, size_t length) {
+  // Registering a region doesn't give the thread any expressions, so it
+  // doesn't become symbolic.
+  std::lock_guard<std::recursive_mutex> lock(g_symbolic_lock);
   registerExpressionRegion({start, length});
 }
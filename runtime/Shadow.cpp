@@ -14,4 +14,382 @@
 
 #include "Shadow.h"
 
-std::map<uintptr_t, SymExpr *> g_shadow_pages;
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#ifdef DIRECT_MAPPED_SHADOW
+#include <sys/mman.h>
+#endif
+
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#endif
+
+PageTable g_shadow_pages;
+size_t g_shadowed_pages;
+ShadowStatistics g_shadow_statistics;
+
+#ifdef DIRECT_MAPPED_SHADOW
+namespace {
+
+void **reserveShadowPageSlots() {
+  // The region is 512 GiB on 64-bit systems, so we can't have the kernel
+  // account for all of it; it only commits the parts that we touch.
+  void *slots = mmap(nullptr, kShadowablePages * sizeof(void *),
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (slots == MAP_FAILED) {
+    perror("Failed to reserve the shadow page table");
+    exit(-1);
+  }
+
+  return static_cast<void **>(slots);
+}
+
+} // namespace
+
+void **g_shadow_page_slots = reserveShadowPageSlots();
+#endif
+
+namespace {
+
+/// The maximum number of released shadow pages that we keep for reuse.
+constexpr size_t kMaxCachedShadowPages = 64;
+
+/// Released shadow pages, ready to be reused. They are entirely concrete, so
+/// there is no need to clear them.
+std::vector<ShadowPage *> g_cached_shadow_pages;
+
+/// Check whether the program has only ever run a single thread.
+///
+/// Other threads look up shadow pages without the symbolic lock (see
+/// Threads.h), so they may still be reading a page after we have released it.
+/// Unless we know that there are no other threads, we therefore keep released
+/// pages around for reuse instead of freeing them.
+bool isSingleThreaded() {
+#if __has_include(<sys/single_threaded.h>)
+  return __libc_single_threaded;
+#else
+  return false;
+#endif
+}
+
+/// Account for memory that shadow management allocates (positive size) or
+/// frees (negative size).
+void recordShadowAllocation(ptrdiff_t bytes) {
+  g_shadow_statistics.currentBytes += bytes;
+  g_shadow_statistics.peakBytes = std::max(g_shadow_statistics.peakBytes,
+                                           g_shadow_statistics.currentBytes);
+}
+
+ShadowPage *allocateShadowPage() {
+  if (!g_cached_shadow_pages.empty()) {
+    auto *page = g_cached_shadow_pages.back();
+    g_cached_shadow_pages.pop_back();
+    return page;
+  }
+
+  g_shadow_statistics.currentPages++;
+  recordShadowAllocation(sizeof(ShadowPage));
+  return static_cast<ShadowPage *>(calloc(1, sizeof(ShadowPage)));
+}
+
+PageTable *allocatePageTable() {
+  g_shadow_statistics.pageTables++;
+  recordShadowAllocation(sizeof(PageTable));
+  return static_cast<PageTable *>(calloc(1, sizeof(PageTable)));
+}
+
+constexpr size_t kWordTableSize =
+    ShadowPage::kWordExpressions * sizeof(SymExpr);
+
+/// Make sure that the page has a table of word expressions.
+void ensureWordExpressions(ShadowPage *page) {
+  if (page->wordExpressions != nullptr)
+    return;
+
+  g_shadow_statistics.currentWordTables++;
+  recordShadowAllocation(kWordTableSize);
+  page->wordExpressions = static_cast<SymExpr *>(
+      calloc(ShadowPage::kWordExpressions, sizeof(SymExpr)));
+}
+
+void deallocateShadowPage(ShadowPage *page) {
+  assert(page->isConcrete() && "Releasing a page with symbolic data");
+
+  if (page->wordExpressions != nullptr) {
+    free(page->wordExpressions);
+    page->wordExpressions = nullptr;
+    g_shadow_statistics.currentWordTables--;
+    recordShadowAllocation(-static_cast<ptrdiff_t>(kWordTableSize));
+  }
+
+  if (g_cached_shadow_pages.size() < kMaxCachedShadowPages ||
+      !isSingleThreaded()) {
+    g_cached_shadow_pages.push_back(page);
+    return;
+  }
+
+  free(page);
+  g_shadow_statistics.currentPages--;
+  recordShadowAllocation(-static_cast<ptrdiff_t>(sizeof(ShadowPage)));
+}
+
+/// Find the page-table entry for the page containing the given address, or
+/// return null if the intermediate tables don't exist.
+void **findShadowPageEntry(uintptr_t addr) {
+#ifdef DIRECT_MAPPED_SHADOW
+  return &g_shadow_page_slots[shadowPageSlot(addr)];
+#else
+  PageTable *table = &g_shadow_pages;
+  for (unsigned level = 0; level < kPageTableLevels - 1; level++) {
+    table =
+        static_cast<PageTable *>(table->entries[pageTableIndex(addr, level)]);
+    if (table == nullptr)
+      return nullptr;
+  }
+
+  return &table->entries[pageTableIndex(addr, kPageTableLevels - 1)];
+#endif
+}
+
+/// Count the symbolic bytes at offsets in [begin, end) on a shadow page.
+size_t countSymbolicBytes(const ShadowPage *page, size_t begin, size_t end) {
+  // Avoid counting in the common cases of entirely concrete or symbolic
+  // pages.
+  if (page->isConcrete())
+    return 0;
+  if (page->symbolicBytes == kPageSize)
+    return end - begin;
+
+  return page->countSymbolic(begin, end);
+}
+
+/// Copy a range of the symbolic bitmap between (or within) shadow pages.
+void copySymbolicBits(ShadowPage *dest, size_t destOffset,
+                      const ShadowPage *src, size_t srcOffset, size_t count) {
+  // Like memmove, copy backwards if the ranges overlap and the destination
+  // comes after the source.
+  if (dest == src && destOffset > srcOffset) {
+    for (size_t end = count; end > 0;) {
+      auto piece = std::min(end, size_t(64));
+      end -= piece;
+      dest->setSymbolicBits(destOffset + end, piece,
+                            src->getSymbolicBits(srcOffset + end, piece));
+    }
+  } else {
+    for (size_t begin = 0; begin < count; begin += 64) {
+      auto piece = std::min(count - begin, size_t(64));
+      dest->setSymbolicBits(destOffset + begin, piece,
+                            src->getSymbolicBits(srcOffset + begin, piece));
+    }
+  }
+}
+
+/// Copy the word expressions that lie entirely within a range of a shadow page
+/// to another (or the same) page. Source and destination offset must have the
+/// same alignment.
+void copyWordExpressions(ShadowPage *dest, size_t destOffset,
+                         const ShadowPage *src, size_t srcOffset,
+                         size_t count) {
+  if (src->wordExpressions == nullptr)
+    return;
+
+  for (size_t size = 2; size <= 8; size *= 2) {
+    // Only words that start and end within the range.
+    auto firstWord = (srcOffset + size - 1) / size * size;
+    auto lastWord = (srcOffset + count) / size * size;
+    if (firstWord >= lastWord)
+      continue;
+
+    auto *first = src->wordExpressions + ShadowPage::wordIndex(size, firstWord);
+    auto *last = src->wordExpressions + ShadowPage::wordIndex(size, lastWord);
+    if (std::all_of(first, last, [](SymExpr expr) { return expr == nullptr; }))
+      continue;
+
+    ensureWordExpressions(dest);
+    std::memmove(dest->wordExpressions +
+                     ShadowPage::wordIndex(size, firstWord - srcOffset +
+                                                     destOffset),
+                 first, (last - first) * sizeof(SymExpr));
+  }
+}
+
+/// Set a page-table entry such that threads reading it without the symbolic
+/// lock see the initialized table or page that it points to.
+void publishEntry(void **entry, void *value) {
+  __atomic_store_n(entry, value, __ATOMIC_RELEASE);
+}
+
+void releaseShadowPage(void **entry) {
+  auto *page = static_cast<ShadowPage *>(*entry);
+  publishEntry(entry, nullptr);
+  g_shadowed_pages--;
+  deallocateShadowPage(page);
+}
+
+} // namespace
+
+ShadowPage *createShadowPage(uintptr_t addr) {
+  assert((addr >> (kShadowAddressBits - 1) >> 1) == 0 &&
+         "Address outside the range covered by the shadow page table");
+
+  PageTable *table = &g_shadow_pages;
+  for (unsigned level = 0; level < kPageTableLevels - 1; level++) {
+    auto &entry = table->entries[pageTableIndex(addr, level)];
+    if (entry == nullptr) {
+#ifdef DIRECT_MAPPED_SHADOW
+      // Last-level tables are slices of the preallocated slot array.
+      if (level == kPageTableLevels - 2)
+        publishEntry(&entry, &g_shadow_page_slots[shadowPageSlot(addr) &
+                                                  ~(kPageTableEntries - 1)]);
+      else
+        publishEntry(&entry, allocatePageTable());
+#else
+      publishEntry(&entry, allocatePageTable());
+#endif
+    }
+    table = static_cast<PageTable *>(entry);
+  }
+
+  auto &entry = table->entries[pageTableIndex(addr, kPageTableLevels - 1)];
+  assert(entry == nullptr && "Page is already shadowed");
+  auto *newShadow = allocateShadowPage();
+  publishEntry(&entry, newShadow);
+  g_shadowed_pages++;
+  return newShadow;
+}
+
+void releaseConcreteShadowPages(uintptr_t addr, size_t length) {
+  for (auto page = pageStart(addr); page < addr + length; page += kPageSize) {
+    auto **entry = findShadowPageEntry(page);
+    if (entry != nullptr && *entry != nullptr &&
+        static_cast<ShadowPage *>(*entry)->isConcrete())
+      releaseShadowPage(entry);
+  }
+}
+
+void clearShadow(uintptr_t addr, size_t length) {
+  auto end = addr + length;
+  for (auto page = pageStart(addr); page < end; page += kPageSize) {
+    auto **entry = findShadowPageEntry(page);
+    if (entry == nullptr || *entry == nullptr)
+      continue;
+
+    auto *shadowPage = static_cast<ShadowPage *>(*entry);
+    auto first = pageOffset(std::max(page, addr));
+    auto last = (end - page >= kPageSize) ? kPageSize : pageOffset(end);
+    if (!shadowPage->isConcrete()) {
+      shadowPage->symbolicBytes -= countSymbolicBytes(shadowPage, first, last);
+      shadowPage->setSymbolic(first, last, false);
+      shadowPage->invalidateWords(first, last);
+      std::fill(shadowPage->expressions + first,
+                shadowPage->expressions + last, nullptr);
+    }
+
+    if (shadowPage->isConcrete())
+      releaseShadowPage(entry);
+  }
+}
+
+void fillShadow(uintptr_t addr, SymExpr value, size_t length) {
+  if (value == nullptr) {
+    clearShadow(addr, length);
+    return;
+  }
+
+  auto end = addr + length;
+  for (auto page = pageStart(addr); page < end; page += kPageSize) {
+    auto *shadowPage = lookupShadowPage(page);
+    if (shadowPage == nullptr)
+      shadowPage = createShadowPage(page);
+
+    auto first = pageOffset(std::max(page, addr));
+    auto last = (end - page >= kPageSize) ? kPageSize : pageOffset(end);
+    shadowPage->symbolicBytes -= countSymbolicBytes(shadowPage, first, last);
+    shadowPage->symbolicBytes += last - first;
+    shadowPage->setSymbolic(first, last, true);
+    shadowPage->invalidateWords(first, last);
+    shadowPage->dirty = true;
+    std::fill(shadowPage->expressions + first, shadowPage->expressions + last,
+              value);
+  }
+}
+
+void copyShadow(uintptr_t dest, uintptr_t src, size_t length) {
+  // We split the range into chunks that don't cross a page boundary in either
+  // source or destination. If the regions overlap and the destination comes
+  // after the source, we need to go backwards (just like memmove).
+  bool backwards = (dest > src) && (dest - src < length);
+
+  size_t done = 0;
+  while (done < length) {
+    size_t remaining = length - done;
+    size_t offset, chunk;
+    if (backwards) {
+      // The chunk ends at offset "remaining" and extends towards the start of
+      // the source and destination pages.
+      chunk = std::min({remaining, pageOffset(src + remaining - 1) + 1,
+                        pageOffset(dest + remaining - 1) + 1});
+      offset = remaining - chunk;
+    } else {
+      offset = done;
+      chunk = std::min({remaining, kPageSize - pageOffset(src + offset),
+                        kPageSize - pageOffset(dest + offset)});
+    }
+    done += chunk;
+
+    auto *srcPage = lookupShadowPage(src + offset);
+    auto *destPage = lookupShadowPage(dest + offset);
+    auto srcFirst = pageOffset(src + offset);
+    auto added = (srcPage == nullptr || srcPage->isConcrete())
+                     ? 0
+                     : countSymbolicBytes(srcPage, srcFirst, srcFirst + chunk);
+    if (added == 0) {
+      // Copying concrete data only matters if the destination has a shadow.
+      if (destPage != nullptr)
+        clearShadow(dest + offset, chunk);
+      continue;
+    }
+
+    if (destPage == nullptr)
+      destPage = createShadowPage(dest + offset);
+
+    auto destFirst = pageOffset(dest + offset);
+    auto removed = countSymbolicBytes(destPage, destFirst, destFirst + chunk);
+    destPage->symbolicBytes = destPage->symbolicBytes - removed + added;
+    destPage->dirty = true;
+    copySymbolicBits(destPage, destFirst, srcPage, srcFirst, chunk);
+    std::memmove(destPage->expressions + destFirst,
+                 srcPage->expressions + srcFirst, chunk * sizeof(SymExpr));
+    destPage->invalidateWords(destFirst, destFirst + chunk);
+    if ((srcFirst - destFirst) % 8 == 0)
+      copyWordExpressions(destPage, destFirst, srcPage, srcFirst, chunk);
+  }
+
+  releaseConcreteShadowPages(dest, length);
+}
+
+void recordWordExpression(uintptr_t addr, size_t length, SymExpr expr) {
+  if ((length != 2 && length != 4 && length != 8) || (addr % length) != 0)
+    return;
+
+  auto *page = lookupShadowPage(addr);
+  assert(page != nullptr && "Recording a word expression without shadow");
+  ensureWordExpressions(page);
+  page->wordExpressions[ShadowPage::wordIndex(length, pageOffset(addr))] =
+      expr;
+  page->dirty = true;
+}
+
+void printShadowStatistics() {
+  std::cerr << "Shadow memory: " << g_shadow_statistics.currentBytes / 1024
+            << " KiB in use (" << g_shadow_statistics.currentPages
+            << " pages, " << g_shadow_statistics.currentWordTables
+            << " word tables, " << g_shadow_statistics.pageTables
+            << " page tables), peak " << g_shadow_statistics.peakBytes / 1024
+            << " KiB" << std::endl;
+}
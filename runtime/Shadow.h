@@ -17,14 +17,16 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <iterator>
-#include <map>
 
 #include <Runtime.h>
 
 #include <z3.h>
 
+#include "Constants.h"
+
 //
 // This file is dedicated to the management of shadow memory.
 //
@@ -37,9 +39,66 @@
 //
 // We represent shadowed memory as a sequence of 8-bit expressions. The
 // iterators therefore expose the shadow in the form of byte expressions.
+// Alongside the expressions, each shadow page keeps track of how many of its
+// bytes are symbolic, so that we can tell quickly whether a page is concrete
+// even after it has been written to symbolically. Moreover, a bitmap with one
+// bit per byte tells which bytes are symbolic; checking a range for symbolic
+// data thus touches 64 times less memory than reading the expressions, which
+// we only need to do for bytes that are actually symbolic. Finally, pages can
+// remember the original expressions written to naturally aligned words, so
+// that a load of the same word doesn't have to reassemble the expression from
+// bytes. Pages that become entirely concrete again are released, and so is the
+// shadow of memory that the program frees or unmaps.
+//
+// The shadow regions are found via a page table that works just like the one
+// of the hardware: it's a radix tree indexed by the page number, with a fixed
+// number of levels. Looking up a page is therefore a constant number of memory
+// accesses, independently of how much memory is shadowed. Intermediate tables
+// are only created when needed, so sparse address spaces are cheap.
+//
+// When the run-time library is built with DIRECT_MAPPED_SHADOW, we reserve
+// (but don't commit) a single region at startup that is large enough to hold
+// all last-level page tables side by side. The slot for a given page is then
+// found arithmetically from its address, and looking up a shadow takes a
+// single memory access. We can't go further and map the expressions
+// themselves at a fixed offset like the sanitizers do: at one 8-byte
+// expression per byte, the shadow of the whole address space wouldn't fit
+// into the address space. The upper levels of the page table are still
+// maintained so that we can enumerate the shadowed pages.
+//
+// In multithreaded programs, shadow memory is only modified under the
+// symbolic lock (see Threads.h), but instrumented code and isConcrete read it
+// without taking the lock. We therefore publish page-table entries atomically,
+// and we never free shadow pages once the program has started a second
+// thread; released pages are kept for reuse instead.
 //
 
 constexpr uintptr_t kPageSize = 4096;
+constexpr unsigned kPageBits = 12;
+static_assert(kPageSize == (uintptr_t(1) << kPageBits),
+              "kPageBits must match kPageSize");
+
+/// The number of address bits covered by the shadow page table.
+///
+/// On 64-bit systems, user-space addresses fit into 48 bits (we don't support
+/// 5-level paging, just like the sanitizers).
+constexpr unsigned kShadowAddressBits = (sizeof(uintptr_t) == 8) ? 48 : 32;
+
+/// The number of levels in the page table.
+constexpr unsigned kPageTableLevels = (sizeof(uintptr_t) == 8) ? 3 : 2;
+
+/// The number of address bits used to index each level of the page table.
+constexpr unsigned kPageTableBits =
+    (kShadowAddressBits - kPageBits) / kPageTableLevels;
+static_assert(kPageBits + kPageTableLevels * kPageTableBits ==
+                  kShadowAddressBits,
+              "The page table must cover the entire address space");
+
+constexpr size_t kPageTableEntries = size_t(1) << kPageTableBits;
+
+/// The number of pages that can be shadowed.
+constexpr size_t kShadowablePages = size_t(1)
+                                    << (kShadowAddressBits - kPageBits);
 
 /// Compute the corresponding page address.
 constexpr uintptr_t pageStart(uintptr_t addr) {
@@ -51,9 +110,299 @@ constexpr uintptr_t pageOffset(uintptr_t addr) {
   return (addr & (kPageSize - 1));
 }
 
-/// A mapping from page addresses to the corresponding shadow regions. Each
-/// shadow is large enough to hold one expression per byte on the shadowed page.
-extern std::map<uintptr_t, SymExpr *> g_shadow_pages;
+/// The shadow of a single page of memory.
+///
+/// The bitmap and the count are derived from the expressions; any code that
+/// modifies expressions needs to keep them in sync.
+struct ShadowPage {
+  static constexpr size_t kBitmapWords = kPageSize / 64;
+
+  /// One expression per byte on the page (null for concrete bytes).
+  SymExpr expressions[kPageSize];
+
+  /// One bit per byte on the page, set iff the expression is non-null.
+  uint64_t symbolicBits[kBitmapWords];
+
+  /// The number of non-null expressions on the page. When it drops to zero,
+  /// the page is entirely concrete and its shadow isn't needed anymore.
+  size_t symbolicBytes;
+
+  /// The number of entries in the table of word expressions: one for each
+  /// naturally aligned 2-, 4- and 8-byte word on the page.
+  static constexpr size_t kWordExpressions = kPageSize - kPageSize / 8;
+
+  /// The expressions that were last written to entire words on the page (or
+  /// null if there is no such table yet).
+  ///
+  /// An entry is only valid as long as none of the word's bytes have been
+  /// modified otherwise; code that modifies expressions needs to invalidate
+  /// it.
+  SymExpr *wordExpressions;
+
+  /// Whether expressions have been written to the page since the last garbage
+  /// collection. Pages that aren't dirty can only contain old expressions (see
+  /// GarbageCollection.h).
+  bool dirty;
+
+  bool isConcrete() const { return symbolicBytes == 0; }
+
+  /// Compute the index into wordExpressions for a word of the given size
+  /// (which must be 2, 4 or 8) at the given offset.
+  static constexpr size_t wordIndex(size_t size, size_t offset) {
+    return kPageSize - 2 * kPageSize / size + offset / size;
+  }
+
+  /// Forget about all word expressions that overlap offsets in [begin, end).
+  void invalidateWords(size_t begin, size_t end) {
+    if (wordExpressions == nullptr)
+      return;
+
+    for (size_t size = 2; size <= 8; size *= 2)
+      std::fill(wordExpressions + wordIndex(size, begin),
+                wordExpressions + wordIndex(size, end + size - 1), nullptr);
+  }
+
+  bool isSymbolic(size_t offset) const {
+    return (symbolicBits[offset / 64] >> (offset % 64)) & 1;
+  }
+
+  void setSymbolic(size_t offset, bool symbolic) {
+    auto bit = uint64_t(1) << (offset % 64);
+    if (symbolic)
+      symbolicBits[offset / 64] |= bit;
+    else
+      symbolicBits[offset / 64] &= ~bit;
+  }
+
+  /// Check whether any byte at an offset in [begin, end) is symbolic.
+  bool anySymbolic(size_t begin, size_t end) const {
+    for (size_t word = begin / 64; begin < end && word <= (end - 1) / 64;
+         word++) {
+      if (symbolicBits[word] & bitmapMask(word, begin, end))
+        return true;
+    }
+
+    return false;
+  }
+
+  /// Count the symbolic bytes at offsets in [begin, end).
+  size_t countSymbolic(size_t begin, size_t end) const {
+    size_t count = 0;
+    for (size_t word = begin / 64; begin < end && word <= (end - 1) / 64;
+         word++)
+      count += __builtin_popcountll(symbolicBits[word] &
+                                    bitmapMask(word, begin, end));
+    return count;
+  }
+
+  /// Mark the bytes at offsets in [begin, end) as symbolic or concrete.
+  void setSymbolic(size_t begin, size_t end, bool symbolic) {
+    for (size_t word = begin / 64; begin < end && word <= (end - 1) / 64;
+         word++) {
+      auto mask = bitmapMask(word, begin, end);
+      if (symbolic)
+        symbolicBits[word] |= mask;
+      else
+        symbolicBits[word] &= ~mask;
+    }
+  }
+
+  /// Read up to 64 bits of the bitmap, starting at the given offset.
+  uint64_t getSymbolicBits(size_t offset, size_t count) const {
+    auto word = offset / 64, shift = offset % 64;
+    auto bits = symbolicBits[word] >> shift;
+    if (shift != 0 && word + 1 < kBitmapWords)
+      bits |= symbolicBits[word + 1] << (64 - shift);
+    return bits & lowBits(count);
+  }
+
+  /// Write up to 64 bits of the bitmap, starting at the given offset.
+  void setSymbolicBits(size_t offset, size_t count, uint64_t bits) {
+    auto word = offset / 64, shift = offset % 64;
+    bits &= lowBits(count);
+    symbolicBits[word] =
+        (symbolicBits[word] & ~(lowBits(count) << shift)) | (bits << shift);
+    if (shift + count > 64) {
+      auto spill = lowBits(shift + count - 64);
+      symbolicBits[word + 1] =
+          (symbolicBits[word + 1] & ~spill) | (bits >> (64 - shift));
+    }
+  }
+
+private:
+  static constexpr uint64_t lowBits(size_t count) {
+    return (count >= 64) ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+  }
+
+  /// Compute the mask of the bits in the given bitmap word that correspond to
+  /// offsets in [begin, end).
+  static constexpr uint64_t bitmapMask(size_t word, size_t begin, size_t end) {
+    auto low = std::max(begin, word * 64) - word * 64;
+    auto high = std::min(end, word * 64 + 64) - word * 64;
+    return lowBits(high - low) << low;
+  }
+};
+
+/// One level of the shadow page table.
+///
+/// The entries of the last level point to shadow pages. On all other levels,
+/// the entries point to the page tables of the next level.
+struct PageTable {
+  void *entries[kPageTableEntries];
+};
+
+/// The root of the shadow page table.
+///
+/// Instrumented code walks the table to skip calls into the run-time library
+/// for accesses to concrete memory (see Symbolizer::createShadowCheck), so the
+/// layout is part of the interface with the compiler pass: changes to the
+/// table geometry need to be reflected in compiler/Runtime.cpp. In particular,
+/// a page without shadow must be entirely concrete.
+extern PageTable g_shadow_pages;
+
+/// The number of pages that currently have a shadow.
+///
+/// Instrumented code reads the counter to find out whether any memory may be
+/// symbolic at all (see Symbolizer::addConcreteDispatch), so it's part of the
+/// interface with the compiler pass as well.
+extern size_t g_shadowed_pages;
+
+/// Compute the index into the page table at the given level for an address.
+constexpr size_t pageTableIndex(uintptr_t addr, unsigned level) {
+  return (addr >> (kPageBits + (kPageTableLevels - 1 - level) * kPageTableBits)) &
+         (kPageTableEntries - 1);
+}
+
+#ifdef DIRECT_MAPPED_SHADOW
+/// The last level of the page table, with one slot for every page in the
+/// address space (reserved at startup).
+extern void **g_shadow_page_slots;
+
+/// Compute the index into g_shadow_page_slots for an address.
+constexpr size_t shadowPageSlot(uintptr_t addr) {
+  return (addr >> kPageBits) & (kShadowablePages - 1);
+}
+#endif
+
+/// Find the shadow for the page containing the given address; return null if
+/// there is none.
+inline ShadowPage *lookupShadowPage(uintptr_t addr) {
+#ifdef DIRECT_MAPPED_SHADOW
+  return static_cast<ShadowPage *>(g_shadow_page_slots[shadowPageSlot(addr)]);
+#else
+  const PageTable *table = &g_shadow_pages;
+  for (unsigned level = 0; level < kPageTableLevels - 1; level++) {
+    table = static_cast<const PageTable *>(
+        table->entries[pageTableIndex(addr, level)]);
+    if (table == nullptr)
+      return nullptr;
+  }
+
+  return static_cast<ShadowPage *>(
+      table->entries[pageTableIndex(addr, kPageTableLevels - 1)]);
+#endif
+}
+
+/// Create a shadow for the page containing the given address, which must not
+/// have a shadow yet.
+ShadowPage *createShadowPage(uintptr_t addr);
+
+/// Release the shadow of all pages in the given memory range that don't
+/// contain symbolic data.
+void releaseConcreteShadowPages(uintptr_t addr, size_t length);
+
+/// Mark the given memory range as concrete and release any shadow pages that
+/// become unused (e.g., because the program freed the memory).
+void clearShadow(uintptr_t addr, size_t length);
+
+/// Set the shadow of every byte in the given memory range to the same
+/// expression.
+void fillShadow(uintptr_t addr, SymExpr value, size_t length);
+
+/// Copy the shadow of one memory range to another; the ranges may overlap.
+///
+/// Unlike the shadow iterators, this operates on entire page-sized chunks at a
+/// time, and it doesn't create shadow for concrete data.
+void copyShadow(uintptr_t dest, uintptr_t src, size_t length);
+
+/// Remember that the given expression was written to memory as a whole, so
+/// that lookupWordExpression can return it. This only has an effect for
+/// naturally aligned 2-, 4- or 8-byte words in little-endian byte order, and
+/// the bytes' shadow must have been updated already.
+void recordWordExpression(uintptr_t addr, size_t length, SymExpr expr);
+
+/// Look up the expression that was last written to the given word of memory
+/// as a whole; return null if there is none or if the word has been modified
+/// since.
+inline SymExpr lookupWordExpression(uintptr_t addr, size_t length) {
+  if ((length != 2 && length != 4 && length != 8) || (addr % length) != 0)
+    return nullptr;
+
+  auto *page = lookupShadowPage(addr);
+  if (page == nullptr || page->wordExpressions == nullptr)
+    return nullptr;
+
+  return page->wordExpressions[ShadowPage::wordIndex(length, pageOffset(addr))];
+}
+
+/// Find the first non-null expression in the given range of expressions;
+/// return last if there is none.
+///
+/// This uses SIMD instructions where the CPU supports them.
+const SymExpr *findSymbolicExpression(const SymExpr *first,
+                                      const SymExpr *last);
+
+/// Statistics on the memory used for shadow pages.
+struct ShadowStatistics {
+  /// The number of shadow pages currently allocated (including those that we
+  /// keep around for reuse).
+  size_t currentPages = 0;
+
+  /// The number of tables of word expressions currently allocated.
+  size_t currentWordTables = 0;
+
+  /// The number of intermediate page tables (which are never released).
+  size_t pageTables = 0;
+
+  /// The memory currently used by all of the above, and its maximum over the
+  /// execution.
+  size_t currentBytes = 0;
+  size_t peakBytes = 0;
+};
+
+extern ShadowStatistics g_shadow_statistics;
+
+/// Print the shadow memory footprint to stderr.
+void printShadowStatistics();
+
+namespace detail {
+
+template <typename F>
+void forEachShadowPageIn(const PageTable *table, unsigned level,
+                         uintptr_t base, F &callback) {
+  for (size_t index = 0; index < kPageTableEntries; index++) {
+    auto *entry = table->entries[index];
+    if (entry == nullptr)
+      continue;
+
+    auto addr =
+        base | (uintptr_t(index)
+                << (kPageBits + (kPageTableLevels - 1 - level) * kPageTableBits));
+    if (level == kPageTableLevels - 1)
+      callback(addr, static_cast<ShadowPage *>(entry));
+    else
+      forEachShadowPageIn(static_cast<const PageTable *>(entry), level + 1,
+                          addr, callback);
+  }
+}
+
+} // namespace detail
+
+/// Call the given function with the page address and the shadow of every
+/// shadowed page, in order of increasing addresses.
+template <typename F> void forEachShadowPage(F callback) {
+  detail::forEachShadowPageIn(&g_shadow_pages, 0, 0, callback);
+}
 
 /// An iterator that walks over the shadow bytes corresponding to a memory
 /// region. If there is no shadow for any given memory address, it just returns
@@ -100,9 +449,8 @@ public:
 
 protected:
   static SymExpr *getShadow(uintptr_t address) {
-    if (auto shadowPageIt = g_shadow_pages.find(pageStart(address));
-        shadowPageIt != g_shadow_pages.end())
-      return shadowPageIt->second + pageOffset(address);
+    if (auto *shadowPage = lookupShadowPage(address))
+      return shadowPage->expressions + pageOffset(address);
 
     return nullptr;
   }
@@ -122,48 +470,88 @@ public:
     if (auto *symbolicResult = ReadShadowIterator::operator*())
       return symbolicResult;
 
-    return _sym_build_integer(*reinterpret_cast<const uint8_t *>(address_), 8);
+    return byteConstant(*reinterpret_cast<const uint8_t *>(address_));
   }
 };
 
 /// An iterator that walks over the shadow corresponding to a memory region and
 /// exposes it for modification. If there is no shadow yet, it creates a new
-/// one.
+/// one as soon as a symbolic expression is written.
 class WriteShadowIterator : public ReadShadowIterator {
 public:
-  WriteShadowIterator(uintptr_t address) : ReadShadowIterator(address) {
-    shadow_ = getOrCreateShadow(address);
-  }
+  /// A reference to the shadow of a single byte. Assigning to it keeps the
+  /// page's count of symbolic bytes up to date.
+  class Reference {
+  public:
+    explicit Reference(WriteShadowIterator &iterator) : iterator_(iterator) {}
+
+    operator SymExpr() const {
+      return iterator_.shadow_ != nullptr ? *iterator_.shadow_ : nullptr;
+    }
+
+    Reference &operator=(SymExpr expr) {
+      if (iterator_.page_ == nullptr) {
+        // Concrete bytes don't need a shadow.
+        if (expr == nullptr)
+          return *this;
+        iterator_.createShadow();
+      }
+
+      auto &page = *iterator_.page_;
+      page.dirty |= (expr != nullptr);
+      page.symbolicBytes += (expr != nullptr);
+      page.symbolicBytes -= (*iterator_.shadow_ != nullptr);
+      page.setSymbolic(pageOffset(iterator_.address_), expr != nullptr);
+      page.invalidateWords(pageOffset(iterator_.address_),
+                           pageOffset(iterator_.address_) + 1);
+      *iterator_.shadow_ = expr;
+      return *this;
+    }
+
+    Reference &operator=(const Reference &other) {
+      return *this = static_cast<SymExpr>(other);
+    }
+
+  private:
+    WriteShadowIterator &iterator_;
+  };
+
+  WriteShadowIterator(uintptr_t address)
+      : ReadShadowIterator(address), page_(lookupShadowPage(address)) {}
 
   WriteShadowIterator &operator++() {
     auto previousAddress = address_++;
-    shadow_++;
+    if (shadow_ != nullptr)
+      shadow_++;
     if (pageStart(address_) != pageStart(previousAddress))
-      shadow_ = getOrCreateShadow(address_);
+      updatePage();
     return *this;
   }
 
   WriteShadowIterator &operator--() {
     auto previousAddress = address_--;
-    shadow_--;
+    if (shadow_ != nullptr)
+      shadow_--;
     if (pageStart(address_) != pageStart(previousAddress))
-      shadow_ = getOrCreateShadow(address_);
+      updatePage();
     return *this;
   }
 
-  SymExpr &operator*() { return *shadow_; }
+  Reference operator*() { return Reference(*this); }
 
 protected:
-  static SymExpr *getOrCreateShadow(uintptr_t address) {
-    if (auto *shadow = getShadow(address))
-      return shadow;
+  void updatePage() {
+    page_ = lookupShadowPage(address_);
+    shadow_ =
+        (page_ != nullptr) ? page_->expressions + pageOffset(address_) : nullptr;
+  }
 
-    auto *newShadow =
-        static_cast<SymExpr *>(malloc(kPageSize * sizeof(SymExpr)));
-    memset(newShadow, 0, kPageSize * sizeof(SymExpr));
-    g_shadow_pages[pageStart(address)] = newShadow;
-    return newShadow + pageOffset(address);
+  void createShadow() {
+    page_ = createShadowPage(address_);
+    shadow_ = page_->expressions + pageOffset(address_);
   }
+
+  ShadowPage *page_;
 };
 
 /// A view on shadow memory that exposes read-only functionality.
@@ -190,10 +578,18 @@ struct ReadOnlyShadow {
 };
 
 /// A view on shadow memory that allows modifications.
+///
+/// Shadow pages that are left without symbolic data are released when the
+/// view goes out of scope, so no iterators must outlive it.
 template <typename T> struct ReadWriteShadow {
   ReadWriteShadow(T *addr, size_t len)
       : address_(reinterpret_cast<uintptr_t>(addr)), length_(len) {}
 
+  ~ReadWriteShadow() { releaseConcreteShadowPages(address_, length_); }
+
+  ReadWriteShadow(const ReadWriteShadow &) = delete;
+  ReadWriteShadow &operator=(const ReadWriteShadow &) = delete;
+
   WriteShadowIterator begin() { return WriteShadowIterator(address_); }
   WriteShadowIterator end() { return WriteShadowIterator(address_ + length_); }
 
@@ -203,16 +599,37 @@ template <typename T> struct ReadWriteShadow {
 
 /// Check whether the indicated memory range is concrete, i.e., there is no
 /// symbolic byte in the entire region.
+///
+/// Thanks to the per-page counts of symbolic bytes, we only need to look at
+/// the bitmap of pages that are partially covered by the region and contain
+/// symbolic data.
 template <typename T> bool isConcrete(T *addr, size_t nbytes) {
-  // Fast path for allocations within one page.
-  auto byteBuf = reinterpret_cast<uintptr_t>(addr);
-  if (pageStart(byteBuf) == pageStart(byteBuf + nbytes) &&
-      !g_shadow_pages.count(pageStart(byteBuf)))
-    return true;
-
-  ReadOnlyShadow shadow(addr, nbytes);
-  return std::all_of(shadow.begin(), shadow.end(),
-                     [](SymExpr expr) { return (expr == nullptr); });
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  auto end = start + nbytes;
+  for (auto page = pageStart(start); page < end; page += kPageSize) {
+    auto *shadowPage = lookupShadowPage(page);
+    if (shadowPage == nullptr || shadowPage->isConcrete())
+      continue;
+
+    auto first = pageOffset(std::max(page, start));
+    auto last = (end - page >= kPageSize) ? kPageSize : pageOffset(end);
+    if (shadowPage->anySymbolic(first, last))
+      return false;
+  }
+
+  return true;
+}
+
+/// Check whether any page in the indicated memory range has a shadow, even if
+/// it's entirely concrete.
+template <typename T> bool hasShadow(T *addr, size_t nbytes) {
+  auto start = reinterpret_cast<uintptr_t>(addr);
+  for (auto page = pageStart(start); page < start + nbytes; page += kPageSize) {
+    if (lookupShadowPage(page) != nullptr)
+      return true;
+  }
+
+  return false;
 }
 
 #endif
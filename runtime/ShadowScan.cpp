@@ -0,0 +1,106 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+//
+// Vectorized scanning of expression regions.
+//
+// Regions of expressions are usually sparse, so a typical scan skips long runs
+// of null expressions. We provide AVX2 and SSE2 kernels that look at 64 bytes
+// per iteration, plus a scalar fallback, and pick the best one for the CPU on
+// first use.
+//
+
+#include "Shadow.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHADOW_SCAN_X86
+#endif
+
+namespace {
+
+/// The number of expressions in 64 bytes.
+constexpr size_t kBlockSize = 64 / sizeof(SymExpr);
+
+using FindFunction = const SymExpr *(*)(const SymExpr *, const SymExpr *);
+
+const SymExpr *findSymbolicScalar(const SymExpr *first, const SymExpr *last) {
+  return std::find_if(first, last,
+                      [](SymExpr expr) { return expr != nullptr; });
+}
+
+#ifdef SHADOW_SCAN_X86
+
+__attribute__((target("avx2"))) const SymExpr *
+findSymbolicAVX2(const SymExpr *first, const SymExpr *last) {
+  while (last - first >= static_cast<ptrdiff_t>(kBlockSize)) {
+    auto *block = reinterpret_cast<const __m256i *>(first);
+    auto any = _mm256_or_si256(_mm256_loadu_si256(block),
+                               _mm256_loadu_si256(block + 1));
+    if (!_mm256_testz_si256(any, any))
+      break;
+    first += kBlockSize;
+  }
+
+  // Locate the expression within the block (or handle the tail).
+  return findSymbolicScalar(first, last);
+}
+
+__attribute__((target("sse2"))) const SymExpr *
+findSymbolicSSE2(const SymExpr *first, const SymExpr *last) {
+  const auto zero = _mm_setzero_si128();
+  while (last - first >= static_cast<ptrdiff_t>(kBlockSize)) {
+    auto *block = reinterpret_cast<const __m128i *>(first);
+    auto any = _mm_or_si128(
+        _mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+        _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xFFFF)
+      break;
+    first += kBlockSize;
+  }
+
+  return findSymbolicScalar(first, last);
+}
+
+#endif
+
+const SymExpr *findSymbolicResolve(const SymExpr *first, const SymExpr *last);
+
+// The kernel starts out as a resolver that selects the implementation on the
+// first call; this is safe even if we're called during static initialization.
+FindFunction g_find_symbolic = findSymbolicResolve;
+
+void selectKernels() {
+  g_find_symbolic = findSymbolicScalar;
+
+#ifdef SHADOW_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    g_find_symbolic = findSymbolicAVX2;
+  else if (__builtin_cpu_supports("sse2"))
+    g_find_symbolic = findSymbolicSSE2;
+#endif
+}
+
+const SymExpr *findSymbolicResolve(const SymExpr *first, const SymExpr *last) {
+  selectKernels();
+  return g_find_symbolic(first, last);
+}
+
+} // namespace
+
+const SymExpr *findSymbolicExpression(const SymExpr *first,
+                                      const SymExpr *last) {
+  return g_find_symbolic(first, last);
+}
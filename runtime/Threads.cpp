@@ -0,0 +1,73 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#include "Threads.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <tuple>
+
+std::recursive_mutex g_symbolic_lock;
+__attribute__((tls_model("initial-exec"))) __thread bool g_is_symbolic_thread;
+
+namespace {
+
+/// Keeps the current thread in the list of symbolic threads until it exits.
+struct SymbolicThreadRegistration {
+  SymbolicThread thread;
+
+  SymbolicThreadRegistration() {
+    thread.handle = pthread_self();
+    std::tie(thread.stackBegin, thread.stackEnd) = findCurrentStack();
+    symbolicThreads().push_back(&thread);
+  }
+
+  ~SymbolicThreadRegistration() {
+    std::lock_guard<std::recursive_mutex> lock(g_symbolic_lock);
+    auto &threads = symbolicThreads();
+    threads.erase(std::find(threads.begin(), threads.end(), &thread));
+  }
+};
+
+} // namespace
+
+std::vector<SymbolicThread *> &symbolicThreads() {
+  // Constructed on first use because threads may register during static
+  // initialization, and never destroyed because threads may still exit after
+  // static destructors have run.
+  static auto *threads = new std::vector<SymbolicThread *>;
+  return *threads;
+}
+
+void registerSymbolicThread() {
+  // Constructed on first use in each thread, destroyed when the thread exits.
+  static thread_local SymbolicThreadRegistration registration;
+  g_is_symbolic_thread = true;
+}
+
+std::pair<uintptr_t, uintptr_t> findCurrentStack() {
+  pthread_attr_t attributes;
+  void *stackAddress;
+  size_t stackSize;
+  if (pthread_getattr_np(pthread_self(), &attributes) != 0 ||
+      pthread_attr_getstack(&attributes, &stackAddress, &stackSize) != 0) {
+    perror("Failed to determine the stack boundaries");
+    exit(-1);
+  }
+
+  pthread_attr_destroy(&attributes);
+  auto begin = reinterpret_cast<uintptr_t>(stackAddress);
+  return {begin, begin + stackSize};
+}
@@ -0,0 +1,132 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef THREADS_H
+#define THREADS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#include <Runtime.h>
+
+//
+// Instrumented programs may run several threads. Concrete code only uses the
+// run-time library for the parameter and return-value accessors, whose state
+// is thread-local, for read-only checks of shadow memory, and for call-stack
+// notifications, which go to a thread-local buffer; so threads that only
+// process concrete data run in parallel without synchronization. Everything
+// else, i.e., creating expressions, modifying shadow memory and solving path
+// constraints, happens under a single lock. This serializes the solver, and it
+// keeps the symbolic state consistent across threads: shadow memory written by
+// one thread is visible to others, and path constraints from all threads end
+// up in the same solver.
+//
+// The lock is recursive because entry points of the run-time library call
+// each other (e.g., reading memory builds concatenations of bytes).
+//
+// Threads that have taken the lock are symbolic: they may hold expressions in
+// registers, on the stack or in thread-local storage. The garbage collector
+// needs a snapshot of those (see GarbageCollection.cpp), so we keep a list of
+// the symbolic threads. Threads that never take the lock don't hold any
+// expressions and can't get hold of one without the lock.
+//
+
+/// The lock protecting all symbolic state.
+extern std::recursive_mutex g_symbolic_lock;
+
+/// A live thread that has taken g_symbolic_lock.
+struct SymbolicThread {
+  pthread_t handle;
+
+  /// The lowest and the highest address of the thread's stack.
+  uintptr_t stackBegin;
+  uintptr_t stackEnd;
+};
+
+/// The list of symbolic threads; only access it while holding g_symbolic_lock.
+std::vector<SymbolicThread *> &symbolicThreads();
+
+/// Whether the current thread has taken g_symbolic_lock before.
+extern __thread bool g_is_symbolic_thread
+    __attribute__((tls_model("initial-exec")));
+
+/// Add the current thread to the list of symbolic threads until it exits. The
+/// caller must hold g_symbolic_lock.
+void registerSymbolicThread();
+
+/// Find the lowest and the highest address of the current thread's stack.
+std::pair<uintptr_t, uintptr_t> findCurrentStack();
+
+/// The number of call-stack notifications that instrumented code has recorded
+/// in the current thread without calling into the run-time library (see
+/// _sym_flush_notifications in RuntimeCommon.cpp).
+extern thread_local size_t g_notification_count
+    __attribute__((tls_model("initial-exec")));
+
+/// The number of buffered notifications that the backend has seen.
+///
+/// Only _sym_flush_notifications empties the buffer: instrumented code may keep
+/// the count in a register across calls to the expression builders, which the
+/// compiler considers not to access memory (see compiler/Runtime.cpp), so
+/// taking g_symbolic_lock must not change it.
+extern thread_local size_t g_processed_notifications
+    __attribute__((tls_model("initial-exec")));
+
+/// The kinds of call-stack notifications, stored in the two least significant
+/// bits of a buffered site ID. The values have to match the ones in
+/// compiler/Runtime.h.
+enum NotificationKind : uintptr_t {
+  kBasicBlockNotification = 0,
+  kCallNotification = 1,
+  kReturnNotification = 2
+};
+
+/// Append a notification to the current thread's buffer, draining the buffer
+/// if it is full. Site IDs lose their two least significant bits.
+void bufferNotification(uintptr_t siteId, NotificationKind kind);
+
+/// Pass the current thread's buffered notifications that the backend hasn't
+/// seen yet on to processNotifications, leaving them in the buffer.
+void drainNotifications();
+
+/// Pass buffered notifications on to the backend's view of the call stack.
+/// Each backend implements this; the caller holds g_symbolic_lock.
+void processNotifications(const uintptr_t *entries, size_t count);
+
+/// Hold g_symbolic_lock for the current scope.
+///
+/// Everything that takes the lock may consult the backend's view of the call
+/// stack, so we pass on the current thread's buffered notifications first.
+class SymbolicLock {
+public:
+  SymbolicLock() {
+    g_symbolic_lock.lock();
+    if (!g_is_symbolic_thread)
+      registerSymbolicThread();
+    if (g_notification_count != g_processed_notifications)
+      drainNotifications();
+  }
+
+  ~SymbolicLock() { g_symbolic_lock.unlock(); }
+
+  SymbolicLock(const SymbolicLock &) = delete;
+  SymbolicLock &operator=(const SymbolicLock &) = delete;
+};
+
+#endif
@@ -0,0 +1,98 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+//
+// Measure the throughput of building expressions.
+//
+// We time two kinds of requests that instrumented code makes frequently:
+// arithmetic that creates a new expression every time (a chain of additions),
+// and concatenations of bytes when loading symbolic words from memory, which
+// tend to repeat expressions that the backend has seen before. We also time
+// loads of words that are only partially symbolic, which need constant
+// expressions for the concrete bytes. Garbage
+// collection is disabled, so the backend's registry of expressions grows to
+// the full number of expressions built.
+//
+// With the QSYM backend, the usual environment variables (SYMCC_INPUT_FILE and
+// SYMCC_OUTPUT_DIR) need to be set for the run-time library to initialize.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+typedef void *SymExpr;
+#include <RuntimeCommon.h>
+
+namespace {
+
+constexpr size_t kDefaultOperations = 1'000'000;
+constexpr size_t kDistinctBytes = 256;
+
+template <typename F> double nanosecondsPerOperation(F operation, size_t count) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; i++)
+    operation(i);
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t operations =
+      (argc > 1) ? std::strtoul(argv[1], nullptr, 0) : kDefaultOperations;
+
+  setenv("SYMCC_GC_THRESHOLD", "4000000000", 1);
+  _sym_initialize();
+
+  auto *symbolicWord = _sym_build_zext(_sym_get_input_byte(0), 24);
+  auto *one = _sym_build_integer(1, 32);
+
+  auto *sum = symbolicWord;
+  auto add = nanosecondsPerOperation(
+      [&](size_t) { sum = _sym_build_add(sum, one); }, operations);
+
+  std::vector<SymExpr> bytes(kDistinctBytes);
+  for (size_t i = 0; i < kDistinctBytes; i++)
+    bytes[i] = _sym_build_trunc(
+        _sym_build_add(symbolicWord, _sym_build_integer(i, 32)), 8);
+
+  auto concat = nanosecondsPerOperation(
+      [&](size_t i) {
+        _sym_concat_helper(bytes[i % kDistinctBytes],
+                           bytes[(i / kDistinctBytes) % kDistinctBytes]);
+      },
+      operations);
+
+  // A word whose lowest byte is symbolic, while the others are concrete.
+  uint32_t word = 0x12345678;
+  _sym_write_memory(reinterpret_cast<uint8_t *>(&word), 1,
+                    _sym_get_input_byte(1), true);
+  auto mixedLoad = nanosecondsPerOperation(
+      [&](size_t) {
+        _sym_read_memory(reinterpret_cast<uint8_t *>(&word), sizeof(word),
+                         true);
+      },
+      operations);
+
+  std::printf("Operations:                  %zu\n", operations);
+  std::printf("_sym_build_add:              %.2f ns\n", add);
+  std::printf("_sym_concat_helper:          %.2f ns\n", concat);
+  std::printf("Partially symbolic load:     %.2f ns\n", mixedLoad);
+  return 0;
+}
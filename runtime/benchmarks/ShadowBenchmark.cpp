@@ -0,0 +1,156 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+//
+// Measure the cost of shadow-memory accesses as seen by instrumented code.
+//
+// We allocate a large buffer, put a single symbolic byte on each of its pages
+// (so that every page has a shadow), and then time loads and stores of
+// concrete data at random locations in the buffer. This is the common case in
+// instrumented programs: the memory is shadowed, but the accessed bytes are
+// concrete, so the cost is dominated by finding the shadow.
+//
+// In addition, we measure bulk operations (memcpy and memset) on a buffer that
+// is entirely symbolic, and a copy between the concrete parts of shadowed
+// pages, which comes down to scanning their shadow for symbolic bytes. Finally,
+// we store a symbolic 32-bit value and load it back.
+//
+// With the QSYM backend, the usual environment variables (SYMCC_INPUT_FILE and
+// SYMCC_OUTPUT_DIR) need to be set for the run-time library to initialize.
+//
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+typedef void *SymExpr;
+#include <RuntimeCommon.h>
+
+namespace {
+
+constexpr size_t kPageSize = 4096;
+constexpr size_t kDefaultPages = 65536; // 256 MiB of shadowed memory
+constexpr size_t kAccesses = 10'000'000;
+constexpr size_t kBulkSize = 1 << 20;
+constexpr size_t kBulkOperations = 100;
+
+template <typename F>
+double nanosecondsPerAccess(F access, size_t accesses = kAccesses) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < accesses; i++)
+    access(i);
+  auto end = std::chrono::steady_clock::now();
+
+  return std::chrono::duration<double, std::nano>(end - start).count() /
+         accesses;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  size_t pages = (argc > 1) ? std::strtoul(argv[1], nullptr, 0) : kDefaultPages;
+
+  _sym_initialize();
+
+  std::vector<uint8_t> shadowed(pages * kPageSize);
+  std::vector<uint8_t> unshadowed(pages * kPageSize);
+  auto *symbolicByte = _sym_get_input_byte(0);
+  for (size_t page = 0; page < pages; page++)
+    _sym_write_memory(&shadowed[page * kPageSize], 1, symbolicByte, true);
+
+  // Pick the access locations up front so that we don't measure the random
+  // number generator. Accesses are 4-byte aligned and never touch the
+  // symbolic byte at the start of each page.
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<size_t> pageDist(0, pages - 1);
+  std::uniform_int_distribution<size_t> offsetDist(1, kPageSize / 4 - 1);
+  std::vector<size_t> offsets(kAccesses);
+  for (auto &offset : offsets)
+    offset = pageDist(rng) * kPageSize + offsetDist(rng) * 4;
+
+  size_t symbolicResults = 0;
+  auto loadShadowed = nanosecondsPerAccess([&](size_t i) {
+    symbolicResults +=
+        (_sym_read_memory(&shadowed[offsets[i]], 4, true) != nullptr);
+  });
+  auto loadUnshadowed = nanosecondsPerAccess([&](size_t i) {
+    symbolicResults +=
+        (_sym_read_memory(&unshadowed[offsets[i]], 4, true) != nullptr);
+  });
+  auto storeShadowed = nanosecondsPerAccess([&](size_t i) {
+    _sym_write_memory(&shadowed[offsets[i]], 4, nullptr, true);
+  });
+
+  std::vector<uint8_t> bulkSource(kBulkSize), bulkDest(kBulkSize),
+      bulkConcrete(kBulkSize);
+  _sym_memset(bulkSource.data(), symbolicByte, kBulkSize);
+  auto bulkCopy = nanosecondsPerAccess(
+      [&](size_t i) {
+        // Shift the destination a little so that source and destination
+        // pages aren't aligned.
+        auto shift = i % 16;
+        _sym_memcpy(bulkDest.data() + shift, bulkSource.data(),
+                    kBulkSize - shift);
+      },
+      kBulkOperations);
+  auto bulkFill = nanosecondsPerAccess(
+      [&](size_t) {
+        _sym_memset(bulkDest.data(), symbolicByte, kBulkSize);
+      },
+      kBulkOperations);
+  auto bulkCopyConcrete = nanosecondsPerAccess(
+      [&](size_t) {
+        _sym_memcpy(bulkDest.data(), bulkConcrete.data(), kBulkSize);
+        _sym_memcpy(bulkDest.data(), bulkSource.data(), kBulkSize);
+      },
+      kBulkOperations);
+
+  auto scanShadowed = nanosecondsPerAccess([&](size_t i) {
+    // Both source and destination are concrete, so the copy only checks the
+    // shadow.
+    auto page = offsets[i] / kPageSize;
+    auto otherPage = (page + 1) % pages;
+    _sym_memcpy(&shadowed[page * kPageSize + 1],
+                &shadowed[otherPage * kPageSize + 1], kPageSize - 1);
+  }, kAccesses / 100);
+
+  auto *symbolicWord = _sym_build_zext(symbolicByte, 24);
+  auto roundTrip = nanosecondsPerAccess(
+      [&](size_t i) {
+        auto *word = &bulkDest[(i % 1024) * 4];
+        _sym_write_memory(word, 4, symbolicWord, true);
+        symbolicResults += (_sym_read_memory(word, 4, true) == nullptr);
+      },
+      kAccesses / 10);
+
+  if (symbolicResults != 0) {
+    std::fprintf(stderr, "Unexpected symbolic result\n");
+    return 1;
+  }
+
+  std::printf("Shadowed pages:              %zu\n", pages);
+  std::printf("Concrete load (shadowed):    %.2f ns\n", loadShadowed);
+  std::printf("Concrete load (no shadow):   %.2f ns\n", loadUnshadowed);
+  std::printf("Concrete store (shadowed):   %.2f ns\n", storeShadowed);
+  std::printf("Symbolic memcpy (1 MiB):     %.2f us\n", bulkCopy / 1000);
+  std::printf("Symbolic memset (1 MiB):     %.2f us\n", bulkFill / 1000);
+  std::printf("Concrete+symbolic memcpy:    %.2f us\n",
+              bulkCopyConcrete / 1000);
+  std::printf("Concrete memcpy (shadowed):  %.2f ns\n", scanShadowed);
+  std::printf("Symbolic store and load:     %.2f ns\n", roundTrip);
+  return 0;
+}
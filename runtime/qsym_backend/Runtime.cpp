@@ -28,12 +28,16 @@
 #error "We need either <filesystem> or the older <experimental/filesystem>."
 #endif
 
+#include <array>
 #include <atomic>
 #include <fstream>
 #include <iostream>
 #include <iterator>
-#include <map>
+#include <memory>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
+#include <vector>
 
 #if HAVE_FILESYSTEM
 #include <filesystem>
@@ -41,11 +45,10 @@
 #include <experimental/filesystem>
 #endif
 
-#ifdef DEBUG_RUNTIME
 #include <chrono>
-#endif
 
 // C
+#include <cassert>
 #include <cstdio>
 
 // Qsym
@@ -60,8 +63,10 @@
 
 // Runtime
 #include <Config.h>
+#include <Constants.h>
 #include <LibcWrappers.h>
 #include <Shadow.h>
+#include <Threads.h>
 
 namespace qsym {
 
@@ -72,6 +77,21 @@ z3::context *g_z3_context;
 
 } // namespace qsym
 
+/// A reference to an expression that C code can handle.
+///
+/// We can't expect C clients to handle std::shared_ptr, so we give them a
+/// pointer to a handle that holds a copy of the shared pointer in order to
+/// keep the expression alive. Getting from a handle to the expression is just
+/// a memory access, and the garbage collector decides when to release our
+/// shared pointer.
+struct ExprHandle {
+  /// The expression (or null if the handle is free).
+  qsym::ExprRef expr;
+
+  /// The next handle in the free list (only used if the handle is free).
+  ExprHandle *nextFree;
+};
+
 namespace {
 
 /// Indicate whether the runtime has been initialized.
@@ -82,27 +102,100 @@ std::string inputFileName;
 
 void deleteInputFile() { std::remove(inputFileName.c_str()); }
 
-/// A mapping of all expressions that we have ever received from Qsym to the
-/// corresponding shared pointers on the heap.
+/// The set of handles for all expressions that we have passed to client code.
 ///
-/// We can't expect C clients to handle std::shared_ptr, so we maintain a single
-/// copy per expression in order to keep the expression alive. The garbage
-/// collector decides when to release our shared pointer.
-///
-/// std::map seems to perform slightly better than std::unordered_map on our
-/// workload.
-std::map<SymExpr, qsym::ExprRef> allocatedExpressions;
+/// Handles are allocated in large blocks and recycled through a free list, so
+/// creating a handle is cheap. They never move, so that we can pass pointers
+/// to them around. Qsym's expression cache often returns an expression that we
+/// have seen before; each expression only gets one handle, so that equal
+/// expressions are identical pointers for client code.
+class ExprHandlePool {
+public:
+  /// Return the handle for the expression, and whether it is new.
+  std::pair<SymExpr, bool> allocate(qsym::ExprRef expr) {
+    auto [existing, inserted] = handles_.try_emplace(expr.get(), nullptr);
+    if (!inserted)
+      return {existing->second, false};
+
+    if (freeList_ == nullptr)
+      addBlock();
+
+    auto *handle = freeList_;
+    freeList_ = handle->nextFree;
+    handle->expr = std::move(expr);
+    existing->second = handle;
+    liveHandles_++;
+    return {handle, true};
+  }
 
-SymExpr registerExpression(const qsym::ExprRef &expr) {
-  SymExpr rawExpr = expr.get();
+  void release(SymExpr handle) {
+    assert(handle->expr != nullptr && "Releasing a free handle");
+    handles_.erase(handle->expr.get());
+    handle->expr.reset();
+    handle->nextFree = freeList_;
+    freeList_ = handle;
+    liveHandles_--;
+  }
 
-  if (allocatedExpressions.count(rawExpr) == 0) {
-    // We don't know this expression yet. Create a copy of the shared pointer to
-    // keep the expression alive.
-    allocatedExpressions[rawExpr] = expr;
+  /// Release all handles that aren't accepted by the given predicate.
+  template <typename F> void sweep(F keep) {
+    for (auto &block : blocks_) {
+      for (auto *handle = block.get(); handle != block.get() + kBlockSize;
+           handle++) {
+        if (handle->expr != nullptr && !keep(handle))
+          release(handle);
+      }
+    }
+  }
+
+  /// The number of handles in use.
+  size_t size() const { return liveHandles_; }
+
+private:
+  static constexpr size_t kBlockSize = 4096;
+
+  void addBlock() {
+    blocks_.push_back(std::make_unique<ExprHandle[]>(kBlockSize));
+    auto *block = blocks_.back().get();
+    for (size_t i = 0; i < kBlockSize; i++)
+      block[i].nextFree = (i + 1 < kBlockSize) ? &block[i + 1] : freeList_;
+    freeList_ = block;
   }
 
-  return rawExpr;
+  std::vector<std::unique_ptr<ExprHandle[]>> blocks_;
+  ExprHandle *freeList_ = nullptr;
+
+  /// The handle of each expression in use.
+  std::unordered_map<const qsym::Expr *, ExprHandle *> handles_;
+  size_t liveHandles_ = 0;
+};
+
+ExprHandlePool allocatedExpressions;
+
+/// The expressions that we have allocated since the last garbage collection.
+std::vector<SymExpr> youngExpressions;
+
+/// The size of youngExpressions, readable without the symbolic lock.
+std::atomic<size_t> youngExpressionCount{0};
+
+void printStatistics() {
+  printGarbageCollectionStatistics(allocatedExpressions.size());
+  printShadowStatistics();
+}
+
+/// The pinned expressions for false and true.
+std::array<SymExpr, 2> g_bool_constants;
+
+SymExpr registerExpression(qsym::ExprRef expr) {
+  // Qsym may return the same expression multiple times (e.g., from its cache),
+  // in which case it keeps its handle and its generation.
+  auto [handle, isNew] = allocatedExpressions.allocate(std::move(expr));
+  if (isNew) {
+    youngExpressions.push_back(handle);
+    youngExpressionCount.store(youngExpressions.size(),
+                               std::memory_order_relaxed);
+  }
+  return handle;
 }
 
 } // namespace
@@ -121,6 +214,8 @@ void _sym_initialize(void) {
 
   loadConfig();
   initLibcWrappers();
+  if (g_config.printStatistics)
+    atexit(printStatistics);
   std::cerr << "This is SymCC running with the QSYM backend" << std::endl;
   if (g_config.fullyConcrete) {
     std::cerr
@@ -176,9 +271,20 @@ void _sym_initialize(void) {
       new Solver(inputFileName, g_config.outputDir, g_config.aflCoverageMap);
   g_expr_builder = g_config.pruning ? PruneExprBuilder::create()
                                     : SymbolicExprBuilder::create();
+
+  initConstantExpressions();
+
+  g_bool_constants = {registerExpression(g_expr_builder->createFalse()),
+                      registerExpression(g_expr_builder->createTrue())};
+  registerExpressionRegion({g_bool_constants.data(), g_bool_constants.size()});
 }
 
 SymExpr _sym_build_integer(uint64_t value, uint8_t bits) {
+  if (auto *pinned = lookupConstantExpression(value, bits))
+    return pinned;
+
+  SymbolicLock lock;
+
   // Qsym's API takes uintptr_t, so we need to be careful when compiling for
   // 32-bit systems: the compiler would helpfully truncate our uint64_t to fit
   // into 32 bits.
@@ -197,31 +303,26 @@ SymExpr _sym_build_integer(uint64_t value, uint8_t bits) {
 }
 
 SymExpr _sym_build_integer128(uint64_t high, uint64_t low) {
+  SymbolicLock lock;
   std::array<uint64_t, 2> words = {low, high};
   return registerExpression(g_expr_builder->createConstant({128, words}, 128));
 }
 
 SymExpr _sym_build_null_pointer() {
-  return registerExpression(
-      g_expr_builder->createConstant(0, sizeof(uintptr_t) * 8));
+  return _sym_build_integer(0, sizeof(uintptr_t) * 8);
 }
 
-SymExpr _sym_build_true() {
-  return registerExpression(g_expr_builder->createTrue());
-}
+SymExpr _sym_build_true() { return g_bool_constants[true]; }
 
-SymExpr _sym_build_false() {
-  return registerExpression(g_expr_builder->createFalse());
-}
+SymExpr _sym_build_false() { return g_bool_constants[false]; }
 
-SymExpr _sym_build_bool(bool value) {
-  return registerExpression(g_expr_builder->createBool(value));
-}
+SymExpr _sym_build_bool(bool value) { return g_bool_constants[value]; }
 
 #define DEF_BINARY_EXPR_BUILDER(name, qsymName)                                \
   SymExpr _sym_build_##name(SymExpr a, SymExpr b) {                            \
-    return registerExpression(g_expr_builder->create##qsymName(                \
-        allocatedExpressions.at(a), allocatedExpressions.at(b)));              \
+    SymbolicLock lock;                                                         \
+    return registerExpression(                                                 \
+        g_expr_builder->create##qsymName(a->expr, b->expr));                   \
   }
 
 DEF_BINARY_EXPR_BUILDER(add, Add)
@@ -257,28 +358,30 @@ DEF_BINARY_EXPR_BUILDER(xor, Xor)
 #undef DEF_BINARY_EXPR_BUILDER
 
 SymExpr _sym_build_neg(SymExpr expr) {
-  return registerExpression(
-      g_expr_builder->createNeg(allocatedExpressions.at(expr)));
+  SymbolicLock lock;
+  return registerExpression(g_expr_builder->createNeg(expr->expr));
 }
 
 SymExpr _sym_build_not(SymExpr expr) {
-  return registerExpression(
-      g_expr_builder->createNot(allocatedExpressions.at(expr)));
+  SymbolicLock lock;
+  return registerExpression(g_expr_builder->createNot(expr->expr));
 }
 
 SymExpr _sym_build_sext(SymExpr expr, uint8_t bits) {
-  return registerExpression(g_expr_builder->createSExt(
-      allocatedExpressions.at(expr), bits + expr->bits()));
+  SymbolicLock lock;
+  return registerExpression(
+      g_expr_builder->createSExt(expr->expr, bits + expr->expr->bits()));
 }
 
 SymExpr _sym_build_zext(SymExpr expr, uint8_t bits) {
-  return registerExpression(g_expr_builder->createZExt(
-      allocatedExpressions.at(expr), bits + expr->bits()));
+  SymbolicLock lock;
+  return registerExpression(
+      g_expr_builder->createZExt(expr->expr, bits + expr->expr->bits()));
 }
 
 SymExpr _sym_build_trunc(SymExpr expr, uint8_t bits) {
-  return registerExpression(
-      g_expr_builder->createTrunc(allocatedExpressions.at(expr), bits));
+  SymbolicLock lock;
+  return registerExpression(g_expr_builder->createTrunc(expr->expr, bits));
 }
 
 void _sym_push_path_constraint(SymExpr constraint, int taken,
@@ -286,28 +389,31 @@ void _sym_push_path_constraint(SymExpr constraint, int taken,
   if (constraint == nullptr)
     return;
 
-  g_solver->addJcc(allocatedExpressions.at(constraint), taken != 0, site_id);
+  SymbolicLock lock;
+  g_solver->addJcc(constraint->expr, taken != 0, site_id);
 }
 
 SymExpr _sym_get_input_byte(size_t offset) {
+  SymbolicLock lock;
   return registerExpression(g_expr_builder->createRead(offset));
 }
 
 SymExpr _sym_concat_helper(SymExpr a, SymExpr b) {
-  return registerExpression(g_expr_builder->createConcat(
-      allocatedExpressions.at(a), allocatedExpressions.at(b)));
+  SymbolicLock lock;
+  return registerExpression(g_expr_builder->createConcat(a->expr, b->expr));
 }
 
 SymExpr _sym_extract_helper(SymExpr expr, size_t first_bit, size_t last_bit) {
+  SymbolicLock lock;
   return registerExpression(g_expr_builder->createExtract(
-      allocatedExpressions.at(expr), last_bit, first_bit - last_bit + 1));
+      expr->expr, last_bit, first_bit - last_bit + 1));
 }
 
-size_t _sym_bits_helper(SymExpr expr) { return expr->bits(); }
+size_t _sym_bits_helper(SymExpr expr) { return expr->expr->bits(); }
 
 SymExpr _sym_build_bool_to_bits(SymExpr expr, uint8_t bits) {
-  return registerExpression(
-      g_expr_builder->boolToBit(allocatedExpressions.at(expr), bits));
+  SymbolicLock lock;
+  return registerExpression(g_expr_builder->boolToBit(expr->expr, bits));
 }
 
 //
@@ -351,17 +457,43 @@ UNSUPPORTED(SymExpr _sym_build_float_to_unsigned_integer(SymExpr, uint8_t))
 //
 // Call-stack tracing
 //
+// QSYM's call-stack manager is a single global object that the expression
+// builder consults, so it is protected by the symbolic lock. Taking the lock
+// for every notification would serialize concrete threads, though; instead,
+// we record the notifications in the thread-local buffer that instrumented
+// code compiled with -symcc-notifications=buffered uses, and the manager only
+// sees them when the thread takes the lock or the buffer is full.
+//
 
 void _sym_notify_call(uintptr_t site_id) {
-  g_call_stack_manager.visitCall(site_id);
+  bufferNotification(site_id, kCallNotification);
 }
 
 void _sym_notify_ret(uintptr_t site_id) {
-  g_call_stack_manager.visitRet(site_id);
+  bufferNotification(site_id, kReturnNotification);
 }
 
 void _sym_notify_basic_block(uintptr_t site_id) {
-  g_call_stack_manager.visitBasicBlock(site_id);
+  bufferNotification(site_id, kBasicBlockNotification);
+}
+
+void processNotifications(const uintptr_t *entries, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    auto siteId = entries[i] & ~uintptr_t{3};
+    switch (entries[i] & 3) {
+    case kBasicBlockNotification:
+      g_call_stack_manager.visitBasicBlock(siteId);
+      break;
+    case kCallNotification:
+      g_call_stack_manager.visitCall(siteId);
+      break;
+    case kReturnNotification:
+      g_call_stack_manager.visitRet(siteId);
+      break;
+    default:
+      assert(false && "Invalid notification kind");
+    }
+  }
 }
 
 //
@@ -369,9 +501,10 @@ void _sym_notify_basic_block(uintptr_t site_id) {
 //
 
 const char *_sym_expr_to_string(SymExpr expr) {
+  SymbolicLock lock;
   static char buffer[4096];
 
-  auto expr_string = expr->toString();
+  auto expr_string = expr->expr->toString();
   auto copied = expr_string.copy(
       buffer, std::min(expr_string.length(), sizeof(buffer) - 1));
   buffer[copied] = '\0';
@@ -380,10 +513,11 @@ const char *_sym_expr_to_string(SymExpr expr) {
 }
 
 bool _sym_feasible(SymExpr expr) {
-  expr->simplify();
+  SymbolicLock lock;
+  expr->expr->simplify();
 
   g_solver->push();
-  g_solver->add(expr->toZ3Expr());
+  g_solver->add(expr->expr->toZ3Expr());
   bool feasible = (g_solver->check() == z3::sat);
   g_solver->pop();
 
@@ -395,27 +529,48 @@ bool _sym_feasible(SymExpr expr) {
 //
 
 void _sym_collect_garbage() {
-  if (allocatedExpressions.size() < g_config.garbageCollectionThreshold)
+  // Check without the lock first because instrumented code calls us very
+  // often. Collecting doesn't give the current thread any expressions, so it
+  // doesn't need to become symbolic.
+  if (!mayNeedGarbageCollection(
+          youngExpressionCount.load(std::memory_order_relaxed)))
     return;
 
-#ifdef DEBUG_RUNTIME
-  auto start = std::chrono::high_resolution_clock::now();
-#endif
+  std::lock_guard<std::recursive_mutex> lock(g_symbolic_lock);
+
+  auto kind = scheduleGarbageCollection(allocatedExpressions.size(),
+                                        youngExpressions.size());
+  if (kind == GarbageCollection::None)
+    return;
+
+  auto start = std::chrono::steady_clock::now();
 
-  auto reachableExpressions = collectReachableExpressions();
-  for (auto expr_it = allocatedExpressions.begin();
-       expr_it != allocatedExpressions.end();) {
-    if (reachableExpressions.count(expr_it->first) == 0) {
-      expr_it = allocatedExpressions.erase(expr_it);
-    } else {
-      ++expr_it;
+  auto reachableExpressions = collectReachableExpressions(kind);
+  if (!reachableExpressions)
+    return;
+
+  if (kind == GarbageCollection::Minor) {
+    for (auto *expr : youngExpressions) {
+      if (!reachableExpressions->contains(expr))
+        allocatedExpressions.release(expr);
     }
+  } else {
+    allocatedExpressions.sweep([&](SymExpr expr) {
+      return reachableExpressions->contains(expr);
+    });
   }
 
-#ifdef DEBUG_RUNTIME
-  auto end = std::chrono::high_resolution_clock::now();
+  // The survivors are old now.
+  youngExpressions.clear();
+  youngExpressionCount.store(0, std::memory_order_relaxed);
+
+  auto end = std::chrono::steady_clock::now();
+  recordGarbageCollection(kind, allocatedExpressions.size(), end - start);
 
-  std::cerr << "After garbage collection: " << allocatedExpressions.size()
+#ifdef DEBUG_RUNTIME
+  std::cerr << "After "
+            << (kind == GarbageCollection::Minor ? "minor" : "major")
+            << " garbage collection: " << allocatedExpressions.size()
             << " expressions remain" << std::endl
             << "\t(collection took "
             << std::chrono::duration_cast<std::chrono::milliseconds>(end -
@@ -17,7 +17,11 @@
 
 #include "expr.h"
 
-typedef qsym::Expr *SymExpr;
+/// The handle for an expression that we pass to instrumented code (see
+/// Runtime.cpp).
+struct ExprHandle;
+
+typedef ExprHandle *SymExpr;
 #include <RuntimeCommon.h>
 
 #endif
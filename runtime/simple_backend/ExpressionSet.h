@@ -0,0 +1,152 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef EXPRESSIONSET_H
+#define EXPRESSIONSET_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Runtime.h"
+
+/// A set of expressions, implemented as a hash table with open addressing.
+///
+/// Every expression that we build passes through the set, so it needs to be
+/// fast. We keep the expressions in a flat array and resolve collisions by
+/// linear probing, with null marking empty slots. Removing an expression
+/// shifts the subsequent entries of its cluster back instead of leaving a
+/// tombstone, so lookups don't degrade as expressions come and go.
+class ExpressionSet {
+public:
+  ExpressionSet() { reset(kMinCapacity); }
+
+  /// Insert an expression; return true if it wasn't in the set yet.
+  bool insert(SymExpr expr) {
+    assert(expr != nullptr && "The set can't hold null");
+
+    // Keep the load factor below 1/2 so that clusters stay short.
+    if (2 * (size_ + 1) > slots_.size())
+      rehash(2 * slots_.size());
+
+    auto index = find(expr);
+    if (slots_[index] != nullptr)
+      return false;
+
+    slots_[index] = expr;
+    size_++;
+    return true;
+  }
+
+  bool contains(SymExpr expr) const { return slots_[find(expr)] != nullptr; }
+
+  /// Remove an expression, which must be in the set.
+  void erase(SymExpr expr) {
+    auto hole = find(expr);
+    assert(slots_[hole] == expr && "Removing an expression that isn't there");
+
+    // Entries further down the cluster may have been placed behind the one
+    // that we remove; move them into the hole if their home slot allows it.
+    for (auto index = next(hole); slots_[index] != nullptr;
+         index = next(index)) {
+      auto distanceFromHome = (index - homeSlot(slots_[index])) & mask();
+      auto distanceFromHole = (index - hole) & mask();
+      if (distanceFromHome >= distanceFromHole) {
+        slots_[hole] = slots_[index];
+        hole = index;
+      }
+    }
+
+    slots_[hole] = nullptr;
+    size_--;
+  }
+
+  /// Remove all expressions for which the predicate returns true.
+  ///
+  /// This is much faster than erasing the expressions one by one when many of
+  /// them go away: we rebuild the table from the survivors, which also lets it
+  /// shrink.
+  template <typename F> void sweep(F shouldRemove) {
+    std::vector<SymExpr> survivors;
+    survivors.reserve(size_);
+    for (auto expr : slots_) {
+      if (expr != nullptr && !shouldRemove(expr))
+        survivors.push_back(expr);
+    }
+
+    // Leave room for growth so that we don't rehash right away.
+    size_t capacity = kMinCapacity;
+    while (capacity < 4 * survivors.size())
+      capacity *= 2;
+
+    reset(capacity);
+    for (auto expr : survivors)
+      slots_[find(expr)] = expr;
+    size_ = survivors.size();
+  }
+
+  size_t size() const { return size_; }
+
+private:
+  static constexpr size_t kMinCapacity = 1024;
+
+  size_t mask() const { return slots_.size() - 1; }
+  size_t next(size_t index) const { return (index + 1) & mask(); }
+
+  size_t homeSlot(SymExpr expr) const {
+    // Fibonacci hashing: the multiplication mixes all bits of the pointer
+    // (whose low bits are always zero) into the high bits of the product.
+    return static_cast<size_t>(
+        (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(expr)) *
+         UINT64_C(0x9E3779B97F4A7C15)) >>
+        shift_);
+  }
+
+  /// Find the slot that holds the expression, or the empty slot where it
+  /// would go.
+  size_t find(SymExpr expr) const {
+    auto index = homeSlot(expr);
+    while (slots_[index] != nullptr && slots_[index] != expr)
+      index = next(index);
+    return index;
+  }
+
+  /// Replace the table with an empty one of the given capacity, which must be
+  /// a power of two.
+  void reset(size_t capacity) {
+    slots_.assign(capacity, nullptr);
+    shift_ = 64;
+    for (auto c = capacity; c > 1; c /= 2)
+      shift_--;
+    size_ = 0;
+  }
+
+  void rehash(size_t capacity) {
+    auto oldSlots = std::move(slots_);
+    auto oldSize = size_;
+    reset(capacity);
+    for (auto expr : oldSlots) {
+      if (expr != nullptr)
+        slots_[find(expr)] = expr;
+    }
+    size_ = oldSize;
+  }
+
+  std::vector<SymExpr> slots_;
+  size_t size_;
+  unsigned shift_;
+};
+
+#endif
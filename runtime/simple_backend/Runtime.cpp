@@ -19,17 +19,17 @@
 #include <cassert>
 #include <cstring>
 #include <iostream>
-#include <set>
 #include <vector>
 
-#ifndef NDEBUG
 #include <chrono>
-#endif
 
 #include "Config.h"
+#include "Constants.h"
+#include "ExpressionSet.h"
 #include "GarbageCollection.h"
 #include "LibcWrappers.h"
 #include "Shadow.h"
+#include "Threads.h"
 
 #ifndef NDEBUG
 // Helper to print pointers properly.
@@ -57,7 +57,10 @@ Z3_context g_context;
 Z3_ast g_rounding_mode;
 
 /// The global Z3 solver.
-Z3_solver g_solver; // TODO make thread-local
+///
+/// Like the context, it's shared by all threads and protected by the symbolic
+/// lock, so queries are serialized.
+Z3_solver g_solver;
 
 // Some global constants for efficiency.
 Z3_ast g_null_pointer, g_true, g_false;
@@ -67,9 +70,10 @@ FILE *g_log = stderr;
 #ifndef NDEBUG
 [[maybe_unused]] void dump_known_regions() {
   std::cerr << "Known regions:" << std::endl;
-  for (const auto &[page, shadow] : g_shadow_pages) {
-    std::cerr << "  " << P(page) << " shadowed by " << P(shadow) << std::endl;
-  }
+  forEachShadowPage([](uintptr_t page, ShadowPage *shadow) {
+    std::cerr << "  " << P(page) << " shadowed by " << P(shadow) << " ("
+              << shadow->symbolicBytes << " symbolic bytes)" << std::endl;
+  });
 }
 
 void handle_z3_error(Z3_context c [[maybe_unused]], Z3_error_code e) {
@@ -90,13 +94,26 @@ Z3_ast build_variable(const char *name, uint8_t bits) {
 }
 
 /// The set of all expressions we have ever passed to client code.
-std::set<SymExpr> allocatedExpressions;
+ExpressionSet allocatedExpressions;
+
+/// The expressions that we have allocated since the last garbage collection.
+std::vector<SymExpr> youngExpressions;
+
+/// The size of youngExpressions, readable without the symbolic lock.
+std::atomic<size_t> youngExpressionCount{0};
+
+void printStatistics() {
+  printGarbageCollectionStatistics(allocatedExpressions.size());
+  printShadowStatistics();
+}
 
 SymExpr registerExpression(Z3_ast expr) {
-  if (allocatedExpressions.count(expr) == 0) {
-    // We don't know this expression yet. Record it and increase the reference
-    // counter.
-    allocatedExpressions.insert(expr);
+  if (allocatedExpressions.insert(expr)) {
+    // We didn't know this expression yet, so we've just recorded it. Increase
+    // the reference counter.
+    youngExpressions.push_back(expr);
+    youngExpressionCount.store(youngExpressions.size(),
+                               std::memory_order_relaxed);
     Z3_inc_ref(g_context, expr);
   }
 
@@ -115,6 +132,8 @@ void _sym_initialize(void) {
 
   loadConfig();
   initLibcWrappers();
+  if (g_config.printStatistics)
+    atexit(printStatistics);
   std::cerr << "This is SymCC running with the simple backend" << std::endl
             << "For anything but debugging SymCC itself, you will want to use "
                "the QSYM backend instead (see README.md for build instructions)"
@@ -153,9 +172,15 @@ void _sym_initialize(void) {
   } else {
     g_log = fopen(g_config.logFile.c_str(), "w");
   }
+
+  initConstantExpressions();
 }
 
 Z3_ast _sym_build_integer(uint64_t value, uint8_t bits) {
+  if (auto *pinned = lookupConstantExpression(value, bits))
+    return pinned;
+
+  SymbolicLock lock;
   auto *sort = Z3_mk_bv_sort(g_context, bits);
   Z3_inc_ref(g_context, (Z3_ast)sort);
   auto *result =
@@ -165,11 +190,13 @@ Z3_ast _sym_build_integer(uint64_t value, uint8_t bits) {
 }
 
 Z3_ast _sym_build_integer128(uint64_t high, uint64_t low) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_concat(
       g_context, _sym_build_integer(high, 64), _sym_build_integer(low, 64)));
 }
 
 Z3_ast _sym_build_float(double value, int is_double) {
+  SymbolicLock lock;
   auto *sort = FSORT(is_double);
   Z3_inc_ref(g_context, (Z3_ast)sort);
   auto *result =
@@ -180,6 +207,7 @@ Z3_ast _sym_build_float(double value, int is_double) {
 
 Z3_ast _sym_get_input_byte(size_t offset) {
   static std::vector<SymExpr> stdinBytes;
+  SymbolicLock lock;
 
   if (offset < stdinBytes.size())
     return stdinBytes[offset];
@@ -199,11 +227,13 @@ Z3_ast _sym_build_false(void) { return g_false; }
 Z3_ast _sym_build_bool(bool value) { return value ? g_true : g_false; }
 
 Z3_ast _sym_build_neg(Z3_ast expr) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_bvneg(g_context, expr));
 }
 
 #define DEF_BINARY_EXPR_BUILDER(name, z3_name)                                 \
   SymExpr _sym_build_##name(SymExpr a, SymExpr b) {                            \
+    SymbolicLock lock;                                                         \
     return registerExpression(Z3_mk_##z3_name(g_context, a, b));               \
   }
 
@@ -242,58 +272,71 @@ DEF_BINARY_EXPR_BUILDER(float_ordered_equal, fpa_eq)
 #undef DEF_BINARY_EXPR_BUILDER
 
 Z3_ast _sym_build_fp_add(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_add(g_context, g_rounding_mode, a, b));
 }
 
 Z3_ast _sym_build_fp_sub(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_sub(g_context, g_rounding_mode, a, b));
 }
 
 Z3_ast _sym_build_fp_mul(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_mul(g_context, g_rounding_mode, a, b));
 }
 
 Z3_ast _sym_build_fp_div(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_div(g_context, g_rounding_mode, a, b));
 }
 
 Z3_ast _sym_build_fp_rem(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_rem(g_context, a, b));
 }
 
 Z3_ast _sym_build_fp_abs(Z3_ast a) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_abs(g_context, a));
 }
 
 Z3_ast _sym_build_not(Z3_ast expr) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_bvnot(g_context, expr));
 }
 
 Z3_ast _sym_build_not_equal(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_not(g_context, Z3_mk_eq(g_context, a, b)));
 }
 
 Z3_ast _sym_build_bool_and(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast operands[] = {a, b};
   return registerExpression(Z3_mk_and(g_context, 2, operands));
 }
 
 Z3_ast _sym_build_bool_or(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast operands[] = {a, b};
   return registerExpression(Z3_mk_or(g_context, 2, operands));
 }
 
 Z3_ast _sym_build_float_ordered_not_equal(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(
       Z3_mk_not(g_context, _sym_build_float_ordered_equal(a, b)));
 }
 
 Z3_ast _sym_build_float_ordered(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   return registerExpression(
       Z3_mk_not(g_context, _sym_build_float_unordered(a, b)));
 }
 
 Z3_ast _sym_build_float_unordered(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[2];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -301,6 +344,7 @@ Z3_ast _sym_build_float_unordered(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_float_unordered_greater_than(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[3];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -309,6 +353,7 @@ Z3_ast _sym_build_float_unordered_greater_than(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_float_unordered_greater_equal(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[3];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -317,6 +362,7 @@ Z3_ast _sym_build_float_unordered_greater_equal(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_float_unordered_less_than(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[3];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -325,6 +371,7 @@ Z3_ast _sym_build_float_unordered_less_than(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_float_unordered_less_equal(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[3];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -333,6 +380,7 @@ Z3_ast _sym_build_float_unordered_less_equal(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_float_unordered_equal(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[3];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -341,6 +389,7 @@ Z3_ast _sym_build_float_unordered_equal(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_float_unordered_not_equal(Z3_ast a, Z3_ast b) {
+  SymbolicLock lock;
   Z3_ast checks[3];
   checks[0] = Z3_mk_fpa_is_nan(g_context, a);
   checks[1] = Z3_mk_fpa_is_nan(g_context, b);
@@ -349,18 +398,22 @@ Z3_ast _sym_build_float_unordered_not_equal(Z3_ast a, Z3_ast b) {
 }
 
 Z3_ast _sym_build_sext(Z3_ast expr, uint8_t bits) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_sign_ext(g_context, bits, expr));
 }
 
 Z3_ast _sym_build_zext(Z3_ast expr, uint8_t bits) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_zero_ext(g_context, bits, expr));
 }
 
 Z3_ast _sym_build_trunc(Z3_ast expr, uint8_t bits) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_extract(g_context, bits - 1, 0, expr));
 }
 
 Z3_ast _sym_build_int_to_float(Z3_ast value, int is_double, int is_signed) {
+  SymbolicLock lock;
   auto *sort = FSORT(is_double);
   Z3_inc_ref(g_context, (Z3_ast)sort);
   auto *result = registerExpression(
@@ -372,6 +425,7 @@ Z3_ast _sym_build_int_to_float(Z3_ast value, int is_double, int is_signed) {
 }
 
 Z3_ast _sym_build_float_to_float(Z3_ast expr, int to_double) {
+  SymbolicLock lock;
   auto *sort = FSORT(to_double);
   Z3_inc_ref(g_context, (Z3_ast)sort);
   auto *result = registerExpression(
@@ -381,6 +435,7 @@ Z3_ast _sym_build_float_to_float(Z3_ast expr, int to_double) {
 }
 
 Z3_ast _sym_build_bits_to_float(Z3_ast expr, int to_double) {
+  SymbolicLock lock;
   if (expr == nullptr)
     return nullptr;
 
@@ -392,22 +447,26 @@ Z3_ast _sym_build_bits_to_float(Z3_ast expr, int to_double) {
 }
 
 Z3_ast _sym_build_float_to_bits(Z3_ast expr) {
+  SymbolicLock lock;
   if (expr == nullptr)
     return nullptr;
   return registerExpression(Z3_mk_fpa_to_ieee_bv(g_context, expr));
 }
 
 Z3_ast _sym_build_float_to_signed_integer(Z3_ast expr, uint8_t bits) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_to_sbv(
       g_context, Z3_mk_fpa_round_toward_zero(g_context), expr, bits));
 }
 
 Z3_ast _sym_build_float_to_unsigned_integer(Z3_ast expr, uint8_t bits) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_fpa_to_ubv(
       g_context, Z3_mk_fpa_round_toward_zero(g_context), expr, bits));
 }
 
 Z3_ast _sym_build_bool_to_bits(Z3_ast expr, uint8_t bits) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_ite(g_context, expr,
                                       _sym_build_integer(1, bits),
                                       _sym_build_integer(0, bits)));
@@ -418,6 +477,8 @@ void _sym_push_path_constraint(Z3_ast constraint, int taken,
   if (constraint == nullptr)
     return;
 
+  SymbolicLock lock;
+
   constraint = Z3_simplify(g_context, constraint);
   Z3_inc_ref(g_context, constraint);
 
@@ -472,15 +533,18 @@ void _sym_push_path_constraint(Z3_ast constraint, int taken,
 }
 
 SymExpr _sym_concat_helper(SymExpr a, SymExpr b) {
+  SymbolicLock lock;
   return registerExpression(Z3_mk_concat(g_context, a, b));
 }
 
 SymExpr _sym_extract_helper(SymExpr expr, size_t first_bit, size_t last_bit) {
+  SymbolicLock lock;
   return registerExpression(
       Z3_mk_extract(g_context, first_bit, last_bit, expr));
 }
 
 size_t _sym_bits_helper(SymExpr expr) {
+  SymbolicLock lock;
   auto *sort = Z3_get_sort(g_context, expr);
   Z3_inc_ref(g_context, (Z3_ast)sort);
   auto result = Z3_get_bv_sort_size(g_context, sort);
@@ -492,13 +556,16 @@ size_t _sym_bits_helper(SymExpr expr) {
 void _sym_notify_call(uintptr_t) {}
 void _sym_notify_ret(uintptr_t) {}
 void _sym_notify_basic_block(uintptr_t) {}
+void processNotifications(const uintptr_t *, size_t) {}
 
 /* Debugging */
 const char *_sym_expr_to_string(SymExpr expr) {
+  SymbolicLock lock;
   return Z3_ast_to_string(g_context, expr);
 }
 
 bool _sym_feasible(SymExpr expr) {
+  SymbolicLock lock;
   expr = Z3_simplify(g_context, expr);
   Z3_inc_ref(g_context, expr);
 
@@ -513,29 +580,59 @@ bool _sym_feasible(SymExpr expr) {
 
 /* Garbage collection */
 void _sym_collect_garbage() {
-  if (allocatedExpressions.size() < g_config.garbageCollectionThreshold)
+  // Check without the lock first because instrumented code calls us very
+  // often. Collecting doesn't give the current thread any expressions, so it
+  // doesn't need to become symbolic.
+  if (!mayNeedGarbageCollection(
+          youngExpressionCount.load(std::memory_order_relaxed)))
     return;
 
+  std::lock_guard<std::recursive_mutex> lock(g_symbolic_lock);
+
+  auto kind = scheduleGarbageCollection(allocatedExpressions.size(),
+                                        youngExpressions.size());
+  if (kind == GarbageCollection::None)
+    return;
+
+  auto start = std::chrono::steady_clock::now();
 #ifndef NDEBUG
-  auto start = std::chrono::high_resolution_clock::now();
   auto startSize = allocatedExpressions.size();
 #endif
 
-  auto reachableExpressions = collectReachableExpressions();
-  for (auto expr_it = allocatedExpressions.begin();
-       expr_it != allocatedExpressions.end();) {
-    if (reachableExpressions.count(*expr_it) == 0) {
-      expr_it = allocatedExpressions.erase(expr_it);
-    } else {
-      ++expr_it;
+  auto reachableExpressions = collectReachableExpressions(kind);
+  if (!reachableExpressions)
+    return;
+
+  if (kind == GarbageCollection::Minor) {
+    for (auto expr : youngExpressions) {
+      if (!reachableExpressions->contains(expr)) {
+        Z3_dec_ref(g_context, expr);
+        allocatedExpressions.erase(expr);
+      }
     }
+  } else {
+    allocatedExpressions.sweep([&](SymExpr expr) {
+      if (reachableExpressions->contains(expr))
+        return false;
+
+      Z3_dec_ref(g_context, expr);
+      return true;
+    });
   }
 
+  // The survivors are old now.
+  youngExpressions.clear();
+  youngExpressionCount.store(0, std::memory_order_relaxed);
+
+  auto end = std::chrono::steady_clock::now();
+  recordGarbageCollection(kind, allocatedExpressions.size(), end - start);
+
 #ifndef NDEBUG
-  auto end = std::chrono::high_resolution_clock::now();
   auto endSize = allocatedExpressions.size();
 
-  std::cerr << "After garbage collection: " << endSize
+  std::cerr << "After "
+            << (kind == GarbageCollection::Minor ? "minor" : "major")
+            << " garbage collection: " << endSize
             << " expressions remain (before: " << startSize << ")" << std::endl
             << "\t(collection took "
             << std::chrono::duration_cast<std::chrono::milliseconds>(end -
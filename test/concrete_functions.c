@@ -0,0 +1,76 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 -mllvm -symcc-concrete-functions %s -S -emit-llvm -o - | FileCheck --check-prefix=BITCODE %s
+// RUN: %symcc -O2 -mllvm -symcc-concrete-functions %s -o %t
+// RUN: echo -ne "\x05" | %t 2>&1 | %filecheck %s
+//
+// Test the concrete clones of functions: the first calls happen before the
+// program reads input, so they can use the clones, but the later calls must
+// still produce the same solver queries as without the option.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// BITCODE-DAG: define internal {{.*}} @checksum.concrete(
+// BITCODE-DAG: define internal {{.*}} @scramble.concrete(
+// BITCODE-NOT: @main.concrete
+
+uint8_t buffer[16];
+size_t length = sizeof(buffer);
+
+__attribute__((noinline)) uint32_t scramble(uint32_t value) {
+  return (value << 3) ^ (value >> 5);
+}
+
+__attribute__((noinline)) uint32_t checksum(const uint8_t *data) {
+  uint32_t result = 0;
+  for (size_t i = 0; i < length; i++)
+    result += scramble(data[i]);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  for (size_t i = 0; i < length; i++)
+    buffer[i] = i;
+
+  fprintf(stderr, "%u\n", checksum(buffer));
+  // ANY: 960
+
+  if (read(STDIN_FILENO, &buffer[length / 2], 1) != 1) {
+    fprintf(stderr, "Failed to read from the input\n");
+    return -1;
+  }
+
+  fprintf(stderr, "%s\n",
+          (scramble(buffer[length / 2]) == 0x151) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x2a
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  fprintf(stderr, "%s\n",
+          (checksum(buffer) == 960 - 64 + 0x80) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x10
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+}
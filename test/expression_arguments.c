@@ -0,0 +1,63 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 %s -o %t
+// RUN: echo -ne "\x05\x00\x00\x00" | %t 2>&1 | %filecheck %s
+// RUN: %symcc -O2 -S -emit-llvm %s -o %t.ll
+// RUN: llvm-as %t.ll -o /dev/null
+// RUN: FileCheck --check-prefix=BITCODE %s < %t.ll
+//
+// Internal functions receive the symbolic expressions of their arguments as
+// additional parameters and return the expression of their result along with
+// the value. Check that this works at -O2, where LLVM marks the parameter of
+// accumulate as "returned" (which must not survive the change of the return
+// type; llvm-as runs the verifier, which clang skips in release builds).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static __attribute__((noinline)) uint32_t *accumulate(uint32_t *total,
+                                                      uint32_t x) {
+  *total += x * 3;
+  return total;
+}
+
+static __attribute__((noinline)) uint32_t mix(uint32_t x, uint32_t y) {
+  return (x ^ y) + 7;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t x;
+  if (read(STDIN_FILENO, &x, sizeof(x)) != sizeof(x)) {
+    fprintf(stderr, "Failed to read x\n");
+    return -1;
+  }
+
+  uint32_t total = 1;
+  uint32_t *result = accumulate(&total, x);
+  fprintf(stderr, "%s\n", (mix(*result, 0x55) == 0x6b) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x10
+  // SIMPLE-DAG: stdin1 -> #x00
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+}
+
+// BITCODE-DAG: define internal {{.*}}{ i32*, i8* } @accumulate(i32* {{[^,]*}}, i32 {{[^,]*}}, i8* {{[^,]*}}, i8* {{[^,]*}})
+// BITCODE-DAG: define internal {{.*}}{ i32, i8* } @mix(i32 {{[^,]*}}, i8* {{[^,]*}})
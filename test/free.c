@@ -0,0 +1,64 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 %s -o %t
+// RUN: echo -ne "\x2a\x2a\x2a\x2a" | %t 2>&1 | %filecheck %s
+//
+// Check that memory loses its symbolic contents when it is freed or unmapped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[]) {
+  char *buffer = malloc(64);
+  if (read(STDIN_FILENO, buffer, 2) != 2) {
+    fprintf(stderr, "Failed to read the input\n");
+    return -1;
+  }
+
+  fprintf(stderr, "%s\n", (buffer[0] == 17) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  // The allocator is likely to hand out the same memory again, but even if it
+  // doesn't, calloc'ed memory must be concrete.
+  free(buffer);
+  volatile char *cleared = calloc(64, 1);
+  fprintf(stderr, "%s\n", (cleared[0] == 17) ? "yes" : "no");
+  // SIMPLE-NOT: Trying to solve
+  // QSYM-NOT: SMT
+  // ANY: no
+
+  char *mapping = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (read(STDIN_FILENO, mapping, 2) != 2) {
+    fprintf(stderr, "Failed to read the input\n");
+    return -1;
+  }
+
+  munmap(mapping, 4096);
+  volatile char *remapped = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  fprintf(stderr, "%s\n", (remapped[1] == 17) ? "yes" : "no");
+  // SIMPLE-NOT: Trying to solve
+  // QSYM-NOT: SMT
+  // ANY: no
+
+  return 0;
+}
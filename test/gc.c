@@ -0,0 +1,52 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 %s -o %t
+// RUN: echo -ne "\x05\x00\x00\x00" | env SYMCC_GC_THRESHOLD=10000 SYMCC_STATISTICS=1 %t 2>&1 | %filecheck %s
+//
+// Check that long-running loops trigger garbage collection, that the collector
+// doesn't release expressions that the program still uses, and that memory
+// stays bounded: without collection, the loop leaves several hundred thousand
+// expressions behind, whereas the collector keeps the count within a small
+// multiple of SYMCC_GC_THRESHOLD.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+volatile uint32_t sink;
+
+int main(int argc, char *argv[]) {
+  uint32_t x;
+  if (read(STDIN_FILENO, &x, sizeof(x)) != sizeof(x)) {
+    fprintf(stderr, "Failed to read x\n");
+    return -1;
+  }
+
+  // Every iteration creates new expressions that are garbage as soon as the
+  // next iteration starts; only the expression for x needs to survive.
+  for (uint32_t i = 0; i < 100000; i++)
+    sink = x * i + 7;
+
+  fprintf(stderr, "%s\n", (x == 42) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x2a
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+  // ANY: Symbolic expressions: {{[0-9]?[0-9]?[0-9]?[0-9]?[0-9]}} live, {{[1-9][0-9]*}} garbage collections
+}
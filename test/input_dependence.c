@@ -0,0 +1,76 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 -DREADER -c %s -o %t_reader.o
+// RUN: %symcc -O2 -mllvm -symcc-input-dependence %s %t_reader.o -o %t 2>&1 | FileCheck --check-prefix=COMPILE %s
+// RUN: echo -ne "\x05\x00\x00\x00\x07" | %t 2>&1 | %filecheck %s
+//
+// Check that the input-dependence analysis doesn't assume that it sees the
+// whole program when the input is read in another translation unit: here, one
+// function returns input, and another one stores input in a global of the
+// main translation unit.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+extern uint8_t last;
+
+#ifdef READER
+
+uint32_t readValue(void) {
+  uint32_t x;
+  if (read(STDIN_FILENO, &x, sizeof(x)) != sizeof(x)) {
+    fprintf(stderr, "Failed to read x\n");
+    return 0;
+  }
+  return x;
+}
+
+void readLast(void) {
+  if (read(STDIN_FILENO, &last, sizeof(last)) != sizeof(last))
+    fprintf(stderr, "Failed to read the last byte\n");
+}
+
+#else
+
+uint8_t last;
+
+uint32_t readValue(void);
+void readLast(void);
+
+int main(int argc, char *argv[]) {
+  // COMPILE: the module doesn't contain the whole program
+  uint32_t x = readValue();
+  fprintf(stderr, "%s\n", (x * 3 == 126) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x2a
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  readLast();
+  fprintf(stderr, "%s\n", (last == 0x42) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin4 -> #x42
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,100 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 -mllvm -symcc-version-loops -fno-discard-value-names %s -S -emit-llvm -o - | FileCheck --check-prefix=BITCODE %s
+// RUN: %symcc -O2 -mllvm -symcc-version-loops %s -o %t
+// RUN: echo -ne "\x05\x03" | %t 2>&1 | %filecheck %s
+//
+// Test loop versioning: the loops below start out in their concrete versions
+// and have to continue in the instrumented versions when they reach the bytes
+// that we read from the input. The nested loop also makes sure that values
+// computed in the loop reach the code after it from both versions.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// Non-constant sizes keep the optimizer from unrolling the loops.
+size_t length = 64;
+size_t rows = 8;
+size_t columns = 8;
+
+uint8_t buffer[64];
+uint8_t matrix[8][8];
+
+// BITCODE-LABEL: define {{.*}} @sum(
+// BITCODE: .concrete:
+unsigned sum(const uint8_t *data) {
+  unsigned result = 0;
+  for (size_t i = 0; i < length; i++)
+    result += data[i];
+  return result;
+}
+
+// BITCODE-LABEL: define {{.*}} @sumRows(
+// BITCODE: .concrete:
+void sumRows(unsigned *total, unsigned *lastRow) {
+  unsigned currentTotal = 0;
+  unsigned currentRow = 0;
+  for (size_t i = 0; i < rows; i++) {
+    currentRow = 0;
+    for (size_t j = 0; j < columns; j++)
+      currentRow += matrix[i][j];
+    currentTotal += currentRow;
+  }
+
+  *total = currentTotal;
+  *lastRow = currentRow;
+}
+
+int main(int argc, char *argv[]) {
+  memset(buffer, 1, sizeof(buffer));
+  memset(matrix, 2, sizeof(matrix));
+
+  if (read(STDIN_FILENO, &buffer[length / 2], 1) != 1) {
+    fprintf(stderr, "Failed to read from the input\n");
+    return -1;
+  }
+
+  // The input byte replaces a 1 in the sum.
+  fprintf(stderr, "%s\n", (sum(buffer) == 63 + 0x2a) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x2a
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  if (read(STDIN_FILENO, &matrix[rows / 2][columns / 2], 1) != 1) {
+    fprintf(stderr, "Failed to read from the input\n");
+    return -1;
+  }
+
+  // The input byte replaces a 2 in the middle row.
+  unsigned total, lastRow;
+  sumRows(&total, &lastRow);
+  fprintf(stderr, "%s\n", (total == 126 + 0x42) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin1 -> #x42
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  fprintf(stderr, "%u\n", lastRow);
+  // ANY: 16
+
+  return 0;
+}
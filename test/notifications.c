@@ -0,0 +1,59 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 -mllvm -symcc-notifications=buffered %s -S -emit-llvm -o - | FileCheck --check-prefix=BITCODE %s
+// RUN: %symcc -O2 -mllvm -symcc-notifications=buffered %s -o %t
+// RUN: echo -ne "\x05\x00\x00\x00" | env SYMCC_ENABLE_LINEARIZATION=1 %t 2>&1 | %filecheck %s
+//
+// Test buffered call-stack notifications: the instrumented code appends to the
+// buffer inline, interleaved with calls to the expression builders (which
+// pass the notifications on to the backend), and the loop fills the buffer
+// several times.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// BITCODE: g_notification_count
+// BITCODE: call void @_sym_flush_notifications()
+
+uint32_t rounds = 3000;
+
+__attribute__((noinline)) uint32_t step(uint32_t state, uint32_t input) {
+  if (state & 1)
+    return state * 3 + input;
+  return state / 2 + input;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t x;
+  if (read(STDIN_FILENO, &x, sizeof(x)) != sizeof(x)) {
+    fprintf(stderr, "Failed to read x\n");
+    return -1;
+  }
+
+  uint32_t state = 1;
+  for (uint32_t i = 0; i < rounds; i++)
+    state = step(state, i & 7);
+
+  fprintf(stderr, "%s\n", (step(state, x) == step(state, 42)) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x2a
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+}
@@ -0,0 +1,55 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// REQUIRES: runtime_bitcode
+// RUN: %symcc -O2 -S -emit-llvm %s -o - | FileCheck --check-prefix=BITCODE %s
+// RUN: %symcc -O2 %s -o %t
+// RUN: echo -ne "\x05\x00\x00\x00" | %t 2>&1 | %filecheck %s
+//
+// Check that the compiler pass inlines the trivial run-time helpers from
+// libSymRuntime.bc (see RUNTIME_BITCODE in docs/Configuration.txt). Functions
+// with external linkage exchange expressions via the thread-local parameter
+// and return slots of the run-time library, which the inlined helpers must
+// access directly rather than through the C++ TLS wrappers.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+__attribute__((noinline)) uint32_t scramble(uint32_t x, uint32_t y) {
+  return (x ^ y) * 3;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t x;
+  if (read(STDIN_FILENO, &x, sizeof(x)) != sizeof(x)) {
+    fprintf(stderr, "Failed to read x\n");
+    return -1;
+  }
+
+  fprintf(stderr, "%s\n", (scramble(x, 0x55) == 0x21c) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE: stdin0 -> #xe1
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+}
+
+// BITCODE-DAG: @g_function_arguments = external thread_local
+// BITCODE-DAG: @g_return_value = external thread_local
+// BITCODE-NOT: call {{.*}}@_sym_{{(get|set)}}_{{(parameter|return)}}_expression(
+// BITCODE-NOT: @_ZTW
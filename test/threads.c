@@ -0,0 +1,70 @@
+// This file is part of SymCC.
+//
+// SymCC is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// SymCC is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+// A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// SymCC. If not, see <https://www.gnu.org/licenses/>.
+
+// RUN: %symcc -O2 -pthread %s -o %t
+// RUN: echo -ne "\x05\x00\x00\x00" | env SYMCC_GC_THRESHOLD=10000 SYMCC_STATISTICS=1 %t 2>&1 | %filecheck %s
+//
+// Check that garbage is collected while several threads handle symbolic data,
+// and that the collector keeps the expressions that a thread holds while
+// another one collects: the main thread computes an expression before waiting
+// for the workers and only uses it afterwards.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define WORKERS 2
+
+uint32_t x;
+volatile uint32_t sink;
+
+void *work(void *arg) {
+  // Every iteration creates new expressions that are garbage as soon as the
+  // next iteration starts.
+  for (uint32_t i = 0; i < 100000; i++)
+    sink = x * i + (uint32_t)(uintptr_t)arg;
+
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  if (read(STDIN_FILENO, &x, sizeof(x)) != sizeof(x)) {
+    fprintf(stderr, "Failed to read x\n");
+    return -1;
+  }
+
+  uint32_t y = x * 3 + 1;
+
+  pthread_t workers[WORKERS];
+  for (uintptr_t i = 0; i < WORKERS; i++) {
+    if (pthread_create(&workers[i], NULL, work, (void *)i) != 0) {
+      fprintf(stderr, "Failed to start a worker\n");
+      return -1;
+    }
+  }
+  for (int i = 0; i < WORKERS; i++)
+    pthread_join(workers[i], NULL);
+
+  fprintf(stderr, "%s\n", (y == 127) ? "yes" : "no");
+  // SIMPLE: Trying to solve
+  // SIMPLE: Found diverging input
+  // SIMPLE-DAG: stdin0 -> #x2a
+  // QSYM-COUNT-2: SMT
+  // QSYM: New testcase
+  // ANY: no
+
+  return 0;
+  // ANY: Symbolic expressions: {{[0-9]?[0-9]?[0-9]?[0-9]?[0-9]}} live, {{[1-9][0-9]*}} garbage collections
+}